@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef ENABLE_ALLOC_COUNT
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#endif
+
+#include "eti-alloc-count.h"
+
+#include <glib-2.0/glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Counts the calls to malloc(), calloc() and realloc() made by the whole
+ * process between eti_alloc_count_start() and eti_alloc_count_stop(), for
+ * the benchmarks. This replaces the C library allocator entry points with
+ * wrappers, so it's only built with ./configure --enable-alloc-count.
+ * Otherwise eti_alloc_count_stop() returns -1.
+ */
+#ifdef ENABLE_ALLOC_COUNT
+
+static gint counting;
+static gssize count;
+
+static void *(*real_malloc)(size_t size);
+static void *(*real_calloc)(size_t n_members, size_t size);
+static void *(*real_realloc)(void *ptr, size_t size);
+static void (*real_free)(void *ptr);
+
+/* dlsym() can allocate while the real functions are being looked up, it is
+ * served from here. This happens during the first allocation, before any
+ * thread is started.
+ */
+static gboolean resolving;
+static union {
+    char data[4096];
+    double align;
+} bootstrap;
+static gsize bootstrap_used;
+
+static gboolean is_bootstrap(void *ptr)
+{
+    return ((char *)ptr >= bootstrap.data)
+           && ((char *)ptr < bootstrap.data + sizeof(bootstrap.data));
+}
+
+static void *bootstrap_alloc(size_t size)
+{
+    void *ptr;
+
+    size = (size + 15) & ~(size_t)15;
+    if (size > sizeof(bootstrap.data) - bootstrap_used)
+        return NULL;
+    ptr = bootstrap.data + bootstrap_used;
+    bootstrap_used += size;
+
+    return ptr;
+}
+
+static void resolve(void)
+{
+    resolving = TRUE;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    resolving = FALSE;
+}
+
+static void count_one(void)
+{
+    if (g_atomic_int_get(&counting))
+        g_atomic_pointer_add(&count, 1);
+}
+
+void *malloc(size_t size)
+{
+    if (real_malloc == NULL) {
+        if (resolving)
+            return bootstrap_alloc(size);
+        resolve();
+    }
+    count_one();
+
+    return real_malloc(size);
+}
+
+void *calloc(size_t n_members, size_t size)
+{
+    if (real_calloc == NULL) {
+        /* the bootstrap buffer is static, so already zeroed */
+        if (resolving)
+            return bootstrap_alloc(n_members * size);
+        resolve();
+    }
+    count_one();
+
+    return real_calloc(n_members, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *copy;
+
+    if (real_realloc == NULL)
+        resolve();
+    if ((ptr != NULL) && is_bootstrap(ptr)) {
+        copy = malloc(size);
+        if (copy != NULL)
+            memcpy(copy, ptr,
+                   MIN(size, (gsize)(bootstrap.data + bootstrap_used
+                                     - (char *)ptr)));
+        return copy;
+    }
+    count_one();
+
+    return real_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if ((ptr == NULL) || is_bootstrap(ptr))
+        return;
+    if (real_free == NULL)
+        resolve();
+
+    real_free(ptr);
+}
+
+void eti_alloc_count_start(void)
+{
+    g_atomic_pointer_set(&count, 0);
+    g_atomic_int_set(&counting, 1);
+}
+
+gint64 eti_alloc_count_stop(void)
+{
+    g_atomic_int_set(&counting, 0);
+
+    return (gint64)g_atomic_pointer_get(&count);
+}
+
+#else
+
+void eti_alloc_count_start(void)
+{
+}
+
+gint64 eti_alloc_count_stop(void)
+{
+    return -1;
+}
+
+#endif
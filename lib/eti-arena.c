@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "eti-arena.h"
+
+#include <glib-2.0/glib.h>
+#include <string.h>
+
+/* Bump allocator for data which all goes away at the same time. Memory is
+ * handed out from large blocks and only given back when the last reference
+ * to the arena is dropped, all at once. Allocations aren't locked: an
+ * arena is filled by a single thread at a time (the parser's worker, or
+ * the EDS conversion), only references can be dropped from any thread.
+ */
+#define ETI_ARENA_BLOCK_SIZE (64 * 1024)
+/* bigger allocations get a block of their own */
+#define ETI_ARENA_MAX_SMALL_SIZE (ETI_ARENA_BLOCK_SIZE / 4)
+#define ETI_ARENA_ALIGNMENT (2 * sizeof(gpointer))
+
+struct _EtiArena {
+    gint ref_count;
+    GSList *blocks;
+    guchar *next;
+    gsize available;
+};
+
+EtiArena *eti_arena_new(void)
+{
+    EtiArena *arena;
+
+    arena = g_new0(EtiArena, 1);
+    arena->ref_count = 1;
+
+    return arena;
+}
+
+EtiArena *eti_arena_ref(EtiArena *arena)
+{
+    g_atomic_int_inc(&arena->ref_count);
+
+    return arena;
+}
+
+void eti_arena_unref(EtiArena *arena)
+{
+    if (!g_atomic_int_dec_and_test(&arena->ref_count))
+        return;
+
+    g_slist_free_full(arena->blocks, g_free);
+    g_free(arena);
+}
+
+gpointer eti_arena_alloc0(EtiArena *arena, gsize size)
+{
+    gpointer data;
+
+    size = (size + ETI_ARENA_ALIGNMENT - 1) & ~(ETI_ARENA_ALIGNMENT - 1);
+
+    if (size > ETI_ARENA_MAX_SMALL_SIZE) {
+        /* keeps the current block in use for the next small ones */
+        data = g_malloc0(size);
+        arena->blocks = g_slist_prepend(arena->blocks, data);
+        return data;
+    }
+    if (size > arena->available) {
+        arena->next = g_malloc(ETI_ARENA_BLOCK_SIZE);
+        arena->available = ETI_ARENA_BLOCK_SIZE;
+        arena->blocks = g_slist_prepend(arena->blocks, arena->next);
+    }
+    data = arena->next;
+    arena->next += size;
+    arena->available -= size;
+
+    memset(data, 0, size);
+
+    return data;
+}
+
+char *eti_arena_strdup(EtiArena *arena, const char *str)
+{
+    if (str == NULL)
+        return NULL;
+
+    return eti_arena_memdup(arena, str, strlen(str) + 1);
+}
+
+gpointer eti_arena_memdup(EtiArena *arena, gconstpointer data, gsize size)
+{
+    gpointer copy;
+
+    if (data == NULL)
+        return NULL;
+
+    copy = eti_arena_alloc0(arena, size);
+    memcpy(copy, data, size);
+
+    return copy;
+}
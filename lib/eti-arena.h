@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef ETI_ARENA_H
+#define ETI_ARENA_H
+
+#include <glib-2.0/glib.h>
+
+typedef struct _EtiArena EtiArena;
+
+EtiArena *eti_arena_new(void);
+EtiArena *eti_arena_ref(EtiArena *arena);
+void eti_arena_unref(EtiArena *arena);
+gpointer eti_arena_alloc0(EtiArena *arena, gsize size);
+char *eti_arena_strdup(EtiArena *arena, const char *str);
+gpointer eti_arena_memdup(EtiArena *arena, gconstpointer data, gsize size);
+
+#endif
@@ -19,6 +19,7 @@
 #include "eti-contact.h"
 #include "eti-plist.h"
 #include <plist/plist.h>
+#include <string.h>
 
 static void plist_add_uid_link(plist_t node, const char *uid)
 {
@@ -32,11 +33,13 @@ static void plist_add_uid_link(plist_t node, const char *uid)
 
 struct IterBuilderContext {
     plist_t dict;
-    plist_t remapped_uids;
+    EtiRemapIndex *remapped_uids;
     const char *main_uid;
     unsigned int count;
     const char *entity_name;
     unsigned int category_id;
+    /* scratch space for get_uid(), shared by the whole build */
+    GString *uid_buffer;
 };
 
 static plist_t create_dict(const char *entity_name, const char *main_uid,
@@ -58,23 +61,46 @@ static plist_t create_dict(const char *entity_name, const char *main_uid,
     return field_info;
 }
 
-static gchar *get_uid(struct IterBuilderContext *context)
+static void append_uint(GString *buffer, unsigned int value)
 {
-    char *uid;
-    char *remapped_uid;
+    char digits[sizeof(value) * 3];
+    char *start;
+
+    start = digits + sizeof(digits);
+    do {
+        *--start = '0' + (value % 10);
+        value /= 10;
+    } while (value != 0);
+    g_string_append_len(buffer, start, digits + sizeof(digits) - start);
+}
 
-    remapped_uid = eti_plist_dict_get_string(context->remapped_uids,
-                                             context->main_uid);
+/* The returned string is only valid until the next call, which is fine for
+ * plist_dict_set_item() as it copies it. This runs for every field of every
+ * contact, so it doesn't allocate.
+ */
+static const char *get_uid(struct IterBuilderContext *context)
+{
+    const char *remapped_uid;
+
+    remapped_uid = eti_remap_index_lookup(context->remapped_uids,
+                                          context->main_uid);
+    g_string_truncate(context->uid_buffer, 0);
+    append_uint(context->uid_buffer, context->category_id);
+    g_string_append_c(context->uid_buffer, '/');
+    g_string_append(context->uid_buffer,
+                    (NULL != remapped_uid) ? remapped_uid : context->main_uid);
+    g_string_append_c(context->uid_buffer, '/');
+    append_uint(context->uid_buffer, context->count);
+
+    /* if the device already knows this field from a previous sync, reuse
+     * its ID so that the field is updated rather than duplicated
+     */
+    remapped_uid = eti_remap_index_lookup(context->remapped_uids,
+                                          context->uid_buffer->str);
     if (NULL != remapped_uid)
-        uid = g_strdup_printf("%d/%s/%d", context->category_id,
-                              remapped_uid, context->count);
-    else
-        uid = g_strdup_printf("%d/%s/%d", context->category_id,
-                              context->main_uid, context->count);
+        return remapped_uid;
 
-    g_free(remapped_uid);
-
-    return uid;
+    return context->uid_buffer->str;
 }
 
 static void add_one_generic(EtiContact *contact, const char *type,
@@ -83,7 +109,7 @@ static void add_one_generic(EtiContact *contact, const char *type,
 {
     plist_t field_info;
     struct IterBuilderContext *context;
-    gchar *local_uid;
+    const char *local_uid;
 
     context = (struct IterBuilderContext *)user_data;
     field_info = create_dict(context->entity_name, context->main_uid,
@@ -94,7 +120,6 @@ static void add_one_generic(EtiContact *contact, const char *type,
 	
 	/* FIXME plist_dict_insert_item’ is deprecated: use plist_dict_set_item instead TW 10/01/16 */
     plist_dict_set_item(context->dict, local_uid, field_info);
-    g_free(local_uid);
 }
 
 static void add_one_date(EtiContact *contact, const char *type,
@@ -103,7 +128,7 @@ static void add_one_date(EtiContact *contact, const char *type,
 {
     plist_t field_info;
     struct IterBuilderContext *context;
-    gchar *local_uid;
+    const char *local_uid;
 
     context = (struct IterBuilderContext *)user_data;
     field_info = create_dict(context->entity_name, context->main_uid,
@@ -114,7 +139,6 @@ static void add_one_date(EtiContact *contact, const char *type,
 
 	/* FIXME plist_dict_insert_item’ is deprecated: use plist_dict_set_item instead TW 10/01/16 */
     plist_dict_set_item(context->dict, local_uid, field_info);
-    g_free(local_uid);
 }
 
 static void add_one_im_user_id(EtiContact *contact, const char *type,
@@ -123,7 +147,7 @@ static void add_one_im_user_id(EtiContact *contact, const char *type,
 {
     plist_t field_info;
     struct IterBuilderContext *context;
-    gchar *local_uid;
+    const char *local_uid;
 
     context = (struct IterBuilderContext *)user_data;
     field_info = create_dict(context->entity_name, context->main_uid,
@@ -134,7 +158,6 @@ static void add_one_im_user_id(EtiContact *contact, const char *type,
     context->count++;
 	/* FIXME plist_dict_insert_item’ is deprecated: use plist_dict_set_item instead TW 10/01/16 */
     plist_dict_set_item(context->dict, local_uid, field_info);
-    g_free(local_uid);
 }
 
 static void add_one_address(EtiContact *contact, const char *type,
@@ -145,7 +168,7 @@ static void add_one_address(EtiContact *contact, const char *type,
 {
     plist_t field_info;
     struct IterBuilderContext *context;
-    gchar *local_uid;
+    const char *local_uid;
 
     context = (struct IterBuilderContext *)user_data;
     field_info = create_dict(context->entity_name, context->main_uid,
@@ -159,45 +182,10 @@ static void add_one_address(EtiContact *contact, const char *type,
     context->count++;
 	/* FIXME plist_dict_insert_item’ is deprecated: use plist_dict_set_item instead TW 10/01/16 */
     plist_dict_set_item(context->dict, local_uid, field_info);
-    g_free(local_uid);
 }
 
 typedef void (*MultiFieldForeach)(EtiContact *contact, gpointer user_data);
 
-static plist_t build_multi_field_plist(GHashTable *contacts,
-                                       MultiFieldForeach field_foreach,
-                                       plist_t remapped_uids)
-{
-    GHashTableIter iter;
-    gpointer key;
-    gpointer value;
-    plist_t dict;
-
-    dict = plist_new_dict();
-    if (dict == NULL)
-        return NULL;
-
-    g_hash_table_iter_init(&iter, contacts);
-    while (g_hash_table_iter_next(&iter, &key, &value)) {
-        char *uid = (char *)key;
-        EtiContact *contact = (EtiContact *)value;
-        struct IterBuilderContext context = {
-            .dict = dict,
-            .remapped_uids = remapped_uids,
-            .main_uid = uid,
-            .count = 0,
-            .entity_name = NULL,
-            .category_id = 0
-        };
-
-        field_foreach(contact, &context);
-    }
-
-    eti_plist_dump(dict);
-
-    return dict;
-}
-
 static void address_foreach(EtiContact *contact, gpointer user_data)
 {
     struct IterBuilderContext *context;
@@ -208,12 +196,6 @@ static void address_foreach(EtiContact *contact, gpointer user_data)
     eti_contact_foreach_address(contact, add_one_address, context);
 }
 
-static plist_t build_addresses_plist(GHashTable *contacts,
-                                     plist_t remapped_uids)
-{
-    return build_multi_field_plist(contacts, address_foreach, remapped_uids);
-}
-
 static void phone_number_foreach(EtiContact *contact, gpointer user_data)
 {
     struct IterBuilderContext *context;
@@ -224,12 +206,6 @@ static void phone_number_foreach(EtiContact *contact, gpointer user_data)
     eti_contact_foreach_phone_number(contact, add_one_generic, context);
 }
 
-static plist_t build_phone_numbers_plist(GHashTable *contacts,
-                                         plist_t remapped_uids)
-{
-    return build_multi_field_plist(contacts, phone_number_foreach, remapped_uids);
-}
-
 static void email_foreach(EtiContact *contact, gpointer user_data)
 {
     struct IterBuilderContext *context;
@@ -240,11 +216,6 @@ static void email_foreach(EtiContact *contact, gpointer user_data)
     eti_contact_foreach_email(contact, add_one_generic, context);
 }
 
-static plist_t build_emails_plist(GHashTable *contacts, plist_t remapped_uids)
-{
-    return build_multi_field_plist(contacts, email_foreach, remapped_uids);
-}
-
 static void im_user_id_foreach(EtiContact *contact, gpointer user_data)
 {
     struct IterBuilderContext *context;
@@ -255,12 +226,6 @@ static void im_user_id_foreach(EtiContact *contact, gpointer user_data)
     eti_contact_foreach_im_user_id(contact, add_one_im_user_id, context);
 }
 
-static plist_t build_im_user_ids_plist(GHashTable *contacts,
-                                       plist_t remapped_uids)
-{
-    return build_multi_field_plist(contacts, im_user_id_foreach, remapped_uids);
-}
-
 static void url_foreach(EtiContact *contact, gpointer user_data)
 {
     struct IterBuilderContext *context;
@@ -271,11 +236,6 @@ static void url_foreach(EtiContact *contact, gpointer user_data)
     eti_contact_foreach_url(contact, add_one_generic, context);
 }
 
-static plist_t build_urls_plist(GHashTable *contacts, plist_t remapped_uids)
-{
-    return build_multi_field_plist(contacts, url_foreach, remapped_uids);
-}
-
 static void date_foreach(EtiContact *contact, gpointer user_data)
 {
     struct IterBuilderContext *context;
@@ -286,9 +246,72 @@ static void date_foreach(EtiContact *contact, gpointer user_data)
     eti_contact_foreach_date(contact, add_one_date, context);
 }
 
-static plist_t build_dates_plist(GHashTable *contacts, plist_t remapped_uids)
+/* Same record as eti_contact_plist_builder_build_contact() without the
+ * "image" key, so that the text fields can be sent ahead of the photos.
+ */
+plist_t
+eti_contact_plist_builder_build_contact_text(EtiContact *contact)
+{
+    plist_t main_info;
+    GDateTime *birthday;
+
+    main_info = plist_new_dict();
+    if (main_info == NULL)
+        return NULL;
+
+	/* FIXME plist_dict_insert_item’ is deprecated: use plist_dict_set_item instead TW 10/01/16 */
+    plist_dict_set_item(main_info,
+                           "com.apple.syncservices.RecordEntityName",
+                           plist_new_string("com.apple.contacts.Contact"));
+    eti_plist_dict_set_string(main_info, "first name",
+                              eti_contact_get_first_name(contact));
+    eti_plist_dict_set_string(main_info, "first name yomi",
+                              eti_contact_get_first_name_yomi(contact));
+    eti_plist_dict_set_string(main_info, "middle name",
+                              eti_contact_get_middle_name(contact));
+    eti_plist_dict_set_string(main_info, "last name",
+                              eti_contact_get_last_name(contact));
+    eti_plist_dict_set_string(main_info, "last name yomi",
+                              eti_contact_get_last_name_yomi(contact));
+    eti_plist_dict_set_string(main_info, "nickname",
+                              eti_contact_get_nickname(contact));
+    eti_plist_dict_set_string(main_info, "title",
+                              eti_contact_get_title(contact));
+    eti_plist_dict_set_string(main_info, "suffix",
+                              eti_contact_get_name_suffix(contact));
+    eti_plist_dict_set_string(main_info, "notes",
+                              eti_contact_get_notes(contact));
+    eti_plist_dict_set_string(main_info, "company name",
+                              eti_contact_get_company_name(contact));
+    eti_plist_dict_set_string(main_info, "department",
+                              eti_contact_get_department(contact));
+    eti_plist_dict_set_string(main_info, "job title",
+                              eti_contact_get_job_title(contact));
+
+    birthday = eti_contact_get_birthday(contact);
+    if (birthday != NULL) {
+        eti_plist_dict_set_date(main_info, "birthday", birthday);
+        g_date_time_unref(birthday);
+    }
+
+    return main_info;
+}
+
+plist_t
+eti_contact_plist_builder_build_contact(EtiContact *contact)
 {
-    return build_multi_field_plist(contacts, date_foreach, remapped_uids);
+    plist_t main_info;
+    const guchar *image_data;
+    size_t data_length;
+
+    main_info = eti_contact_plist_builder_build_contact_text(contact);
+    if (main_info == NULL)
+        return NULL;
+
+    eti_contact_get_photo(contact, &image_data, &data_length);
+    eti_plist_dict_set_data(main_info, "image", image_data, data_length);
+
+    return main_info;
 }
 
 plist_t
@@ -307,55 +330,14 @@ eti_contact_plist_builder_build_main(GHashTable *contacts)
         char *uid = (char *)key;
         EtiContact *contact = (EtiContact *)value;
         plist_t main_info;
-        GDateTime *birthday;
-        const guchar *image_data;
-        size_t data_length;
 
-        main_info = plist_new_dict();
+        main_info = eti_contact_plist_builder_build_contact(contact);
         if (main_info == NULL) {
             g_warning("couldn't create plist for %s", uid);
             continue;
         }
 
 	/* FIXME plist_dict_insert_item’ is deprecated: use plist_dict_set_item instead TW 10/01/16 */
-        plist_dict_set_item(main_info,
-                               "com.apple.syncservices.RecordEntityName",
-                               plist_new_string("com.apple.contacts.Contact"));
-        eti_plist_dict_set_string(main_info, "first name",
-                                  eti_contact_get_first_name(contact));
-        eti_plist_dict_set_string(main_info, "first name yomi",
-                                  eti_contact_get_first_name_yomi(contact));
-        eti_plist_dict_set_string(main_info, "middle name",
-                                  eti_contact_get_middle_name(contact));
-        eti_plist_dict_set_string(main_info, "last name",
-                                  eti_contact_get_last_name(contact));
-        eti_plist_dict_set_string(main_info, "last name yomi",
-                                  eti_contact_get_last_name_yomi(contact));
-        eti_plist_dict_set_string(main_info, "nickname",
-                                  eti_contact_get_nickname(contact));
-        eti_plist_dict_set_string(main_info, "title",
-                                  eti_contact_get_title(contact));
-        eti_plist_dict_set_string(main_info, "suffix",
-                                  eti_contact_get_name_suffix(contact));
-        eti_plist_dict_set_string(main_info, "notes",
-                                  eti_contact_get_notes(contact));
-        eti_plist_dict_set_string(main_info, "company name",
-                                  eti_contact_get_company_name(contact));
-        eti_plist_dict_set_string(main_info, "department",
-                                  eti_contact_get_department(contact));
-        eti_plist_dict_set_string(main_info, "job title",
-                                  eti_contact_get_job_title(contact));
-
-        birthday = eti_contact_get_birthday(contact);
-        if (birthday != NULL) {
-            eti_plist_dict_set_date(main_info, "birthday", birthday);
-            g_date_time_unref(birthday);
-        }
-
-        eti_contact_get_photo(contact, &image_data, &data_length);
-        eti_plist_dict_set_data(main_info, "image", image_data, data_length);
-	/* FIXME plist_dict_insert_item’ is deprecated: use plist_dict_set_item instead TW 10/01/16 */
-
         plist_dict_set_item(main_plist, uid, main_info);
     }
 
@@ -364,25 +346,83 @@ eti_contact_plist_builder_build_main(GHashTable *contacts)
     return main_plist;
 }
 
+/* in the order of the plists returned by
+ * eti_contact_plist_builder_build_others()
+ */
+static const MultiFieldForeach other_foreachs[ETI_CONTACT_PLIST_BUILDER_N_OTHERS] = {
+    address_foreach,
+    phone_number_foreach,
+    email_foreach,
+    im_user_id_foreach,
+    url_foreach,
+    date_foreach
+};
+
+/* Builds the address, phone number, email, IM, URL and date records, in
+ * this order, with a single pass over @contacts
+ */
 GList *
 eti_contact_plist_builder_build_others(GHashTable *contacts,
-                                       plist_t remapped_uids)
+                                       EtiRemapIndex *remapped_uids)
 {
+    plist_t dicts[ETI_CONTACT_PLIST_BUILDER_N_OTHERS];
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
     GList *plists = NULL;
+    GString *uid_buffer;
+    guint i;
+
+    for (i = 0; i < ETI_CONTACT_PLIST_BUILDER_N_OTHERS; i++)
+        dicts[i] = plist_new_dict();
+    uid_buffer = g_string_sized_new(64);
+
+    g_hash_table_iter_init(&iter, contacts);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        EtiContact *contact = (EtiContact *)value;
+
+        for (i = 0; i < ETI_CONTACT_PLIST_BUILDER_N_OTHERS; i++) {
+            struct IterBuilderContext context = {
+                .dict = dicts[i],
+                .remapped_uids = remapped_uids,
+                .main_uid = (const char *)key,
+                .count = 0,
+                .entity_name = NULL,
+                .category_id = 0,
+                .uid_buffer = uid_buffer
+            };
+
+            other_foreachs[i](contact, &context);
+        }
+    }
+    g_string_free(uid_buffer, TRUE);
 
-    plists = g_list_prepend(plists, build_addresses_plist(contacts,
-                                                          remapped_uids));
-    plists = g_list_prepend(plists, build_phone_numbers_plist(contacts,
-                                                              remapped_uids));
-    plists = g_list_prepend(plists, build_emails_plist(contacts,
-                                                       remapped_uids));
-    plists = g_list_prepend(plists, build_im_user_ids_plist(contacts,
-                                                            remapped_uids));
-    plists = g_list_prepend(plists, build_urls_plist(contacts,
-                                                     remapped_uids));
-    plists = g_list_prepend(plists, build_dates_plist(contacts,
-                                                      remapped_uids));
-
-    return g_list_reverse(plists);
+    for (i = ETI_CONTACT_PLIST_BUILDER_N_OTHERS; i > 0; i--)
+        plists = g_list_prepend(plists, dicts[i - 1]);
+
+    return plists;
+}
+
+/* Returns the ID of the contact a field record built by get_uid() belongs
+ * to, or NULL if @uid isn't the ID of a field record
+ */
+gchar *eti_contact_plist_builder_get_field_owner(const char *uid)
+{
+    const char *start;
+    const char *end;
+
+    start = strchr(uid, '/');
+    end = strrchr(uid, '/');
+    if ((start == NULL) || (start == end))
+        return NULL;
+
+    return g_strndup(start + 1, end - start - 1);
 }
 
+/* Records sent without any content are deleted by the device */
+void eti_contact_plist_builder_add_deleted(plist_t entities,
+                                           const char *record_id)
+{
+    plist_dict_set_item(entities, record_id,
+                        plist_new_string("___EmptyParameterString___"));
+}
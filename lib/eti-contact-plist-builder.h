@@ -21,10 +21,22 @@
 #include <glib-2.0/glib.h>
 #include <plist/plist.h>
 
+#include "eti-contact.h"
+#include "eti-remap-index.h"
+
 GList *eti_contact_plist_builder_build(GHashTable *contacts);
+plist_t eti_contact_plist_builder_build_contact(EtiContact *contact);
+plist_t eti_contact_plist_builder_build_contact_text(EtiContact *contact);
 plist_t eti_contact_plist_builder_build_main(GHashTable *contacts);
 GList *eti_contact_plist_builder_build_others(GHashTable *contacts,
-                                              plist_t remapped_uids);
+                                              EtiRemapIndex *remapped_uids);
+
+/* number of plists returned by eti_contact_plist_builder_build_others() */
+#define ETI_CONTACT_PLIST_BUILDER_N_OTHERS 6
+
+gchar *eti_contact_plist_builder_get_field_owner(const char *uid);
+void eti_contact_plist_builder_add_deleted(plist_t entities,
+                                           const char *record_id);
 
 #endif
 
@@ -25,21 +25,29 @@
 
 struct _EtiContactPlistParser {
     GHashTable *contacts;
+    /* parent contact ID -> PendingChild array, for the records received
+     * before the contact they belong to
+     */
+    GHashTable *pending;
+    /* memory of the parsed contacts */
+    EtiArena *arena;
 };
 
-#define PARSE_FIELD(fieldstring, fieldname)                     \
-    do {                                                        \
-        value = eti_plist_dict_get_string(entity, fieldstring); \
-        if (value != NULL) {                                    \
-            eti_contact_set_##fieldname(contact, value);        \
-            free(value);                                        \
-        }                                                       \
+/* The strings are read in place when libplist allows it, the setters then
+ * copy them straight to the parser's arena
+ */
+#define PARSE_FIELD(fieldstring, fieldname)                               \
+    do {                                                                  \
+        value = eti_plist_dict_peek_string(entity, fieldstring, &copy);   \
+        eti_contact_set_##fieldname(contact, value);                      \
+        free(copy);                                                       \
     } while (0)
 
 static gboolean parse_contact_main_info(EtiContact *contact, plist_t entity,
                                         GError **error)
 {
-    char *value;
+    const char *value;
+    char *copy;
     GDateTime *date;
     guchar *image_data;
     guint64 data_length;
@@ -64,150 +72,147 @@ static gboolean parse_contact_main_info(EtiContact *contact, plist_t entity,
     }
 
     image_data = eti_plist_dict_get_data(entity, "image", &data_length);
-    eti_contact_set_photo_from_data(contact, image_data, data_length);
-    free(image_data);
+    eti_contact_take_photo(contact, image_data, data_length);
 
     return TRUE;
 }
 
-typedef void (*ContactAttributeSetter)(EtiContact *contact,
-                                       const char *type,
-                                       const char *label,
-                                       const char *value);
-static gboolean parse_contact_generic(EtiContact *contact,
-                                      ContactAttributeSetter setter,
-                                      plist_t entity,
+typedef void (*ContactAttributeAdder)(EtiContact *contact,
+                                      const char *type,
+                                      const char *label,
+                                      const char *value);
+
+struct EntityDescriptor;
+typedef gboolean (*EntityParseFunc)(EtiContact *contact, plist_t entity,
+                                    const struct EntityDescriptor *descriptor,
+                                    GError **error);
+
+struct EntityDescriptor {
+    /* without the com.apple.contacts. prefix */
+    const char *name;
+    /* NULL for the main contact records */
+    EntityParseFunc parse;
+    /* used by parse_contact_generic() */
+    ContactAttributeAdder add;
+};
+
+static gboolean parse_contact_generic(EtiContact *contact, plist_t entity,
+                                      const struct EntityDescriptor *descriptor,
                                       GError **error)
 {
-    char *type;
-    char *label;
-    char *value;
-
-    type = eti_plist_dict_get_string(entity, "type");
+    const char *type;
+    const char *label;
+    const char *value;
+    char *type_copy;
+    char *label_copy;
+    char *value_copy;
+
+    type = eti_plist_dict_peek_string(entity, "type", &type_copy);
     if (type == NULL) {
         g_set_error(error, ETI_CONTACT_ERROR,
                     ETI_CONTACT_ERROR_PARSING,
                     "missing 'type' field in entity");
         return FALSE;
     }
-    value = eti_plist_dict_get_string(entity, "value");
+    value = eti_plist_dict_peek_string(entity, "value", &value_copy);
     if (value == NULL) {
         g_set_error(error, ETI_CONTACT_ERROR,
                     ETI_CONTACT_ERROR_PARSING,
                     "missing 'value' field in entity");
-        free(type);
+        free(type_copy);
         return FALSE;
     }
     /* 'label' is only set for custom categories, it's NULL for the
      * predefined categories. For custom categories, 'type' will be set to
      * 'other'
      */
-    label = eti_plist_dict_get_string(entity, "label");
-    setter(contact, type, label, value);
-    free(type);
-    free(value);
-    free(label);
+    label = eti_plist_dict_peek_string(entity, "label", &label_copy);
+    descriptor->add(contact, type, label, value);
+    free(type_copy);
+    free(label_copy);
+    free(value_copy);
 
     return TRUE;
 }
 
-static gboolean parse_contact_phone_number(EtiContact *contact, plist_t entity,
-                                           GError **error)
-{
-    return parse_contact_generic(contact, eti_contact_add_phone_number,
-                                 entity, error);
-}
-
 static gboolean parse_contact_address(EtiContact *contact, plist_t entity,
+                                      const struct EntityDescriptor *descriptor,
                                       GError **error)
 {
-    char *type;
-    char *label;
-    char *postal_code;
-    char *city;
-    char *country;
-    char *country_code;
-    char *street;
-
-    type = eti_plist_dict_get_string(entity, "type");
+    const char *type;
+    const char *label;
+    const char *street;
+    const char *postal_code;
+    const char *city;
+    const char *country;
+    const char *country_code;
+    char *copies[7];
+    guint i;
+
+    type = eti_plist_dict_peek_string(entity, "type", &copies[0]);
     if (type == NULL) {
         g_set_error(error, ETI_CONTACT_ERROR,
                     ETI_CONTACT_ERROR_PARSING,
                     "missing 'type' field in address entity");
         return FALSE;
     }
-    label = eti_plist_dict_get_string(entity, "label");
-    street = eti_plist_dict_get_string(entity, "street");
-    postal_code = eti_plist_dict_get_string(entity, "postal code");
-    city = eti_plist_dict_get_string(entity, "city");
-    country = eti_plist_dict_get_string(entity, "country");
-    country_code = eti_plist_dict_get_string(entity, "country code");
+    label = eti_plist_dict_peek_string(entity, "label", &copies[1]);
+    street = eti_plist_dict_peek_string(entity, "street", &copies[2]);
+    postal_code = eti_plist_dict_peek_string(entity, "postal code",
+                                             &copies[3]);
+    city = eti_plist_dict_peek_string(entity, "city", &copies[4]);
+    country = eti_plist_dict_peek_string(entity, "country", &copies[5]);
+    country_code = eti_plist_dict_peek_string(entity, "country code",
+                                              &copies[6]);
 
     eti_contact_add_address(contact, type, label, street, postal_code,
                             city, country, country_code);
-
-    free(type);
-    free(label);
-    free(street);
-    free(postal_code);
-    free(city);
-    free(country);
-    free(country_code);
+    for (i = 0; i < G_N_ELEMENTS(copies); i++)
+        free(copies[i]);
 
     return TRUE;
 }
 
 static gboolean parse_contact_im(EtiContact *contact, plist_t entity,
+                                 const struct EntityDescriptor *descriptor,
                                  GError **error)
 {
-    char *type;
-    char *label;
-    char *service;
-    char *user_id;
-
-    type = eti_plist_dict_get_string(entity, "type");
+    const char *type;
+    const char *label;
+    const char *service;
+    const char *user_id;
+    char *copies[4];
+    guint i;
+
+    type = eti_plist_dict_peek_string(entity, "type", &copies[0]);
     if (type == NULL) {
         g_set_error(error, ETI_CONTACT_ERROR,
                     ETI_CONTACT_ERROR_PARSING,
                     "missing 'type' field in IM entity");
         return FALSE;
     }
-    label = eti_plist_dict_get_string(entity, "label");
-    service = eti_plist_dict_get_string(entity, "service");
-    user_id = eti_plist_dict_get_string(entity, "user");
+    label = eti_plist_dict_peek_string(entity, "label", &copies[1]);
+    service = eti_plist_dict_peek_string(entity, "service", &copies[2]);
+    user_id = eti_plist_dict_peek_string(entity, "user", &copies[3]);
 
     eti_contact_add_im_user_id(contact, type, label, service, user_id);
-
-    free(type);
-    free(label);
-    free(service);
-    free(user_id);
+    for (i = 0; i < G_N_ELEMENTS(copies); i++)
+        free(copies[i]);
 
     return TRUE;
 }
 
-static gboolean parse_contact_email(EtiContact *contact, plist_t entity,
-                                    GError **error)
-{
-    return parse_contact_generic(contact, eti_contact_add_email,
-                                 entity, error);
-}
-
-static gboolean parse_contact_url(EtiContact *contact, plist_t entity,
-                                  GError **error)
-{
-    return parse_contact_generic(contact, eti_contact_add_url,
-                                 entity, error);
-}
-
 static gboolean parse_contact_date(EtiContact *contact, plist_t entity,
+                                   const struct EntityDescriptor *descriptor,
                                    GError **error)
 {
-    char *type;
-    char *label;
+    const char *type;
+    const char *label;
+    char *type_copy;
+    char *label_copy;
     GDateTime *date;
 
-    type = eti_plist_dict_get_string(entity, "type");
+    type = eti_plist_dict_peek_string(entity, "type", &type_copy);
     if (type == NULL) {
         g_set_error(error, ETI_CONTACT_ERROR,
                     ETI_CONTACT_ERROR_PARSING,
@@ -220,38 +225,34 @@ static gboolean parse_contact_date(EtiContact *contact, plist_t entity,
         g_set_error(error, ETI_CONTACT_ERROR,
                     ETI_CONTACT_ERROR_PARSING,
                     "missing 'value' field in date entity");
-        free(type);
+        free(type_copy);
         return FALSE;
     }
-    label = eti_plist_dict_get_string(entity, "label");
+    label = eti_plist_dict_peek_string(entity, "label", &label_copy);
 
     eti_contact_add_date(contact, type, label, date);
-
     g_date_time_unref(date);
-    free(type);
-    free(label);
+    free(type_copy);
+    free(label_copy);
 
     return TRUE;
 }
 
-static EtiContact *create_new_contact(const char *id, plist_t entity,
-                                      GHashTable *contacts, GError **error)
+static EtiContact *create_new_contact(EtiContactPlistParser *parser,
+                                      const char *id, plist_t entity,
+                                      GError **error)
 {
     char *display_as;
     EtiContact *contact;
 
+    /* the records we build don't have it, the device then shows them as
+     * persons
+     */
     display_as = eti_plist_dict_get_string(entity, "display as company");
-    if (display_as == NULL) {
-        g_set_error(error, ETI_CONTACT_ERROR,
-                    ETI_CONTACT_ERROR_PARSING,
-                    "missing 'display as company' field in main entity");
-        return NULL;
-    }
-
-    if (strcmp(display_as, "person") == 0)
-        contact = eti_contact_new_person(NULL, NULL);
+    if ((display_as == NULL) || (strcmp(display_as, "person") == 0))
+        contact = eti_contact_new_person_in_arena(parser->arena, NULL, NULL);
     else if (strcmp(display_as, "company") == 0)
-        contact = eti_contact_new_company(NULL);
+        contact = eti_contact_new_company_in_arena(parser->arena, NULL);
     else {
         g_set_error(error, ETI_CONTACT_ERROR,
                     ETI_CONTACT_ERROR_PARSING,
@@ -268,18 +269,17 @@ static EtiContact *create_new_contact(const char *id, plist_t entity,
         g_assert((error == NULL) || (*error != NULL));
         return NULL;
     }
-    g_hash_table_insert(contacts, g_strdup(id), contact);
+    g_hash_table_insert(parser->contacts, g_strdup(id), contact);
 
     return contact;
 }
 
-static EtiContact *get_existing_contact(plist_t entity, GHashTable *contacts,
-                                        GError **error)
+/* Returns the ID of the contact @entity belongs to, to be freed with free() */
+static char *get_parent_id(plist_t entity, GError **error)
 {
     plist_t contact_ids;
     plist_t contact_id;
     char *id;
-    EtiContact *contact;
 
     contact_ids = plist_dict_get_item(entity, "contact");
     if (contact_ids == NULL) {
@@ -312,23 +312,117 @@ static EtiContact *get_existing_contact(plist_t entity, GHashTable *contacts,
     }
     plist_get_string_val(contact_id, &id);
 
-    contact = g_hash_table_lookup(contacts, id);
-    free(id);
+    return id;
+}
 
-    return contact;
+/* The entity names all have a different length, which is used as the index
+ * in this table
+ */
+static const struct EntityDescriptor entity_descriptors[] = {
+    [2] = { "IM", parse_contact_im, NULL },
+    [3] = { "URL", parse_contact_generic, eti_contact_add_url },
+    [4] = { "Date", parse_contact_date, NULL },
+    [7] = { "Contact", NULL, NULL },
+    [12] = { "Phone Number", parse_contact_generic,
+             eti_contact_add_phone_number },
+    [13] = { "Email Address", parse_contact_generic, eti_contact_add_email },
+    [14] = { "Street Address", parse_contact_address, NULL },
+};
+
+#define ENTITY_PREFIX "com.apple.contacts."
+
+static const struct EntityDescriptor *lookup_entity(const char *entity_name)
+{
+    const struct EntityDescriptor *descriptor;
+    gsize len;
+
+    if (strncmp(entity_name, ENTITY_PREFIX, strlen(ENTITY_PREFIX)) != 0)
+        return NULL;
+    entity_name += strlen(ENTITY_PREFIX);
+    len = strlen(entity_name);
+    if (len >= G_N_ELEMENTS(entity_descriptors))
+        return NULL;
+    descriptor = &entity_descriptors[len];
+    if ((descriptor->name == NULL)
+            || (memcmp(descriptor->name, entity_name, len) != 0))
+        return NULL;
+
+    return descriptor;
+}
+
+struct PendingChild {
+    const struct EntityDescriptor *descriptor;
+    plist_t entity;
+};
+
+static void pending_child_free(struct PendingChild *child)
+{
+    plist_free(child->entity);
+    g_free(child);
+}
+
+/* The device can send a record before the contact it belongs to, for
+ * example when they end up in different messages. Such records are kept
+ * until the contact shows up.
+ */
+static void add_pending_child(EtiContactPlistParser *parser,
+                              const char *parent_id,
+                              const struct EntityDescriptor *descriptor,
+                              plist_t entity)
+{
+    GPtrArray *children;
+    struct PendingChild *child;
+
+    children = g_hash_table_lookup(parser->pending, parent_id);
+    if (children == NULL) {
+        children = g_ptr_array_new_with_free_func((GDestroyNotify)pending_child_free);
+        g_hash_table_insert(parser->pending, g_strdup(parent_id), children);
+    }
+    child = g_new0(struct PendingChild, 1);
+    child->descriptor = descriptor;
+    child->entity = plist_copy(entity);
+    g_ptr_array_add(children, child);
 }
 
-static gboolean parse_contact_info(const char *key, plist_t entity,
-                                   GHashTable *contacts, GError **error)
+static void attach_pending_children(EtiContactPlistParser *parser,
+                                    const char *id, EtiContact *contact)
 {
-    char *entity_name;
-    const char *info_type;
+    GPtrArray *children;
+    guint i;
+
+    children = g_hash_table_lookup(parser->pending, id);
+    if (children == NULL)
+        return;
+
+    for (i = 0; i < children->len; i++) {
+        struct PendingChild *child = g_ptr_array_index(children, i);
+        GError *error = NULL;
+
+        if (!child->descriptor->parse(contact, child->entity,
+                                      child->descriptor, &error)) {
+            g_warning("failed to parse %s record of contact %s: %s",
+                      child->descriptor->name, id, error->message);
+            g_error_free(error);
+        }
+    }
+    g_hash_table_remove(parser->pending, id);
+}
+
+static gboolean parse_contact_info(EtiContactPlistParser *parser,
+                                   const char *key, plist_t entity,
+                                   GError **error)
+{
+    const char *entity_name;
+    char *entity_name_copy;
+    const struct EntityDescriptor *descriptor;
+    char *parent_id;
     EtiContact *contact;
     gboolean parse_ok;
 
     parse_ok = FALSE;
-    entity_name = eti_plist_dict_get_string(entity,
-                                            "com.apple.syncservices.RecordEntityName");
+    entity_name = eti_plist_dict_peek_string(entity,
+                                             "com.apple.syncservices.RecordEntityName",
+                                             &entity_name_copy);
     if (entity_name == NULL) {
         g_set_error(error, ETI_CONTACT_ERROR,
                     ETI_CONTACT_ERROR_PARSING,
@@ -336,45 +430,36 @@ static gboolean parse_contact_info(const char *key, plist_t entity,
         goto out;
     }
 
-    if (!g_str_has_prefix(entity_name, "com.apple.contacts.")) {
+    descriptor = lookup_entity(entity_name);
+    if (descriptor == NULL) {
         g_set_error(error, ETI_CONTACT_ERROR,
                     ETI_CONTACT_ERROR_PARSING,
-                    "Entity name doesn't have com.apple.contacts. prefix (%s)",
-                    entity_name);
+                    "Unknown entity name: %s", entity_name);
         goto out;
     }
 
-    info_type = entity_name + strlen("com.apple.contacts.");
-    if (strcmp(info_type, "Contact") == 0) {
-        contact = create_new_contact(key, entity, contacts, error);
+    if (descriptor->parse == NULL) {
+        contact = create_new_contact(parser, key, entity, error);
         parse_ok = (contact != NULL);
+        if (parse_ok)
+            attach_pending_children(parser, key, contact);
         goto out;
-    } else {
-        contact = get_existing_contact(entity, contacts, error);
-        if (contact == NULL)
-            goto out;
     }
 
-    if (strcmp(info_type, "Email Address") == 0) {
-        parse_ok = parse_contact_email(contact, entity, error);
-    } else if (strcmp(info_type, "Phone Number") == 0) {
-        parse_ok = parse_contact_phone_number(contact, entity, error);
-    } else if (strcmp(info_type, "Street Address") == 0) {
-        parse_ok = parse_contact_address(contact, entity, error);
-    } else if (strcmp(info_type, "IM") == 0) {
-        parse_ok = parse_contact_im(contact, entity, error);
-    } else if (strcmp(info_type, "URL") == 0) {
-        parse_ok = parse_contact_url(contact, entity, error);
-    } else if (strcmp(info_type, "Date") == 0) {
-        parse_ok = parse_contact_date(contact, entity, error);
+    parent_id = get_parent_id(entity, error);
+    if (parent_id == NULL)
+        goto out;
+    contact = g_hash_table_lookup(parser->contacts, parent_id);
+    if (contact != NULL) {
+        parse_ok = descriptor->parse(contact, entity, descriptor, error);
     } else {
-        g_set_error(error, ETI_CONTACT_ERROR,
-                    ETI_CONTACT_ERROR_PARSING,
-                    "Unknown entity name: %s", info_type);
+        add_pending_child(parser, parent_id, descriptor, entity);
+        parse_ok = TRUE;
     }
+    free(parent_id);
 
 out:
-    free(entity_name);
+    free(entity_name_copy);
     g_assert(parse_ok || (error == NULL) || (*error != NULL));
     return parse_ok;
 }
@@ -413,7 +498,16 @@ gboolean eti_contact_plist_parser_parse(EtiContactPlistParser *parser,
         key = NULL;
         plist_dict_next_item(entities, iter, &key, &node);
         while (node) {
-            parse_contact_info(key, node, parser->contacts, error);
+            GError *record_error = NULL;
+
+            /* a bad record doesn't prevent parsing the others, @error
+             * is only for plists which can't be parsed at all
+             */
+            if (!parse_contact_info(parser, key, node, &record_error)) {
+                g_warning("failed to parse record %s: %s", key,
+                          record_error->message);
+                g_error_free(record_error);
+            }
             free(key);
             plist_dict_next_item(entities, iter, &key, &node);
         }
@@ -431,10 +525,37 @@ EtiContactPlistParser *eti_contact_plist_parser_new(void)
     parser->contacts = g_hash_table_new_full(g_str_hash, g_str_equal,
                                              g_free,
                                              (GDestroyNotify)eti_contact_free);
+    parser->pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify)g_ptr_array_unref);
+    parser->arena = eti_arena_new();
 
     return parser;
 }
 
+/* To be called once all the records have been parsed. Drops the records
+ * whose contact never showed up, and returns how many there were.
+ */
+guint eti_contact_plist_parser_finish(EtiContactPlistParser *parser)
+{
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+    guint n_orphans;
+
+    n_orphans = 0;
+    g_hash_table_iter_init(&iter, parser->pending);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        GPtrArray *children = (GPtrArray *)value;
+
+        g_warning("dropping %u records of unknown contact %s",
+                  children->len, (const char *)key);
+        n_orphans += children->len;
+    }
+    g_hash_table_remove_all(parser->pending);
+
+    return n_orphans;
+}
+
 GHashTable *eti_contact_plist_parser_get_contacts(EtiContactPlistParser *parser)
 {
     return parser->contacts;
@@ -445,6 +566,9 @@ void eti_contact_plist_parser_free(EtiContactPlistParser *parser,
 {
     if (free_contacts)
         g_hash_table_destroy(parser->contacts);
+    g_hash_table_destroy(parser->pending);
+    /* the contacts keep the arena alive when they aren't freed */
+    eti_arena_unref(parser->arena);
     g_free(parser);
 }
 
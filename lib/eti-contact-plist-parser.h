@@ -26,6 +26,7 @@ typedef struct _EtiContactPlistParser EtiContactPlistParser;
 EtiContactPlistParser *eti_contact_plist_parser_new(void);
 gboolean eti_contact_plist_parser_parse(EtiContactPlistParser *parser,
                                         plist_t entities, GError **error);
+guint eti_contact_plist_parser_finish(EtiContactPlistParser *parser);
 GHashTable *eti_contact_plist_parser_get_contacts(EtiContactPlistParser *parser);
 void eti_contact_plist_parser_free(EtiContactPlistParser *parser,
                                    gboolean free_contacts);
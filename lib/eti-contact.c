@@ -16,8 +16,10 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1335 USA 
  */
 #include "eti-contact.h"
+#include "eti-arena.h"
 
 #include <glib-2.0/glib.h>
+#include <string.h>
 
 
 GQuark eti_contact_error_quark(void)
@@ -59,8 +61,55 @@ struct _EtiContact {
     GList *urls;
     GList *dates;
     EtiContactPhoto photo;
+    /* NULL when the contact owns its memory */
+    EtiArena *arena;
 };
 
+/* Contacts created in an arena get their strings and fields from it.
+ * Photos and dates are not, they are owned by the contact as usual so that
+ * replacing them gives the memory back. The helpers below pick the right
+ * allocator for @contact.
+ */
+static gpointer contact_alloc0(EtiContact *contact, gsize size)
+{
+    if (contact->arena != NULL)
+        return eti_arena_alloc0(contact->arena, size);
+
+    return g_malloc0(size);
+}
+
+static char *contact_strdup(EtiContact *contact, const char *str)
+{
+    if (contact->arena != NULL)
+        return eti_arena_strdup(contact->arena, str);
+
+    return g_strdup(str);
+}
+
+/* for strings being replaced, arena memory is only reclaimed at the end */
+static void contact_release_str(EtiContact *contact, char *str)
+{
+    if (contact->arena == NULL)
+        g_free(str);
+}
+
+static GList *contact_list_prepend(EtiContact *contact, GList *list,
+                                   gpointer data)
+{
+    GList *link;
+
+    if (contact->arena == NULL)
+        return g_list_prepend(list, data);
+
+    link = eti_arena_alloc0(contact->arena, sizeof(GList));
+    link->data = data;
+    link->next = list;
+    if (list != NULL)
+        list->prev = link;
+
+    return link;
+}
+
 struct _EtiContactGenericMultifield {
     char *type;
     char *label;
@@ -77,7 +126,8 @@ struct _EtiContactAddress {
 };
 typedef struct _EtiContactAddress EtiContactAddress;
 
-static EtiContactAddress *eti_contact_address_new(const char *street,
+static EtiContactAddress *eti_contact_address_new(EtiContact *contact,
+                                                  const char *street,
                                                   const char *postal_code,
                                                   const char *city,
                                                   const char *country,
@@ -85,17 +135,12 @@ static EtiContactAddress *eti_contact_address_new(const char *street,
 {
     EtiContactAddress *address;
 
-    address = g_new0(EtiContactAddress, 1);
-    if (street != NULL)
-        address->street = g_strdup(street);
-    if (postal_code != NULL)
-        address->postal_code = g_strdup(postal_code);
-    if (city != NULL)
-        address->city = g_strdup(city);
-    if (country != NULL)
-        address->country = g_strdup(country);
-    if (country_code != NULL)
-        address->country_code = g_strdup(country_code);
+    address = contact_alloc0(contact, sizeof(EtiContactAddress));
+    address->street = contact_strdup(contact, street);
+    address->postal_code = contact_strdup(contact, postal_code);
+    address->city = contact_strdup(contact, city);
+    address->country = contact_strdup(contact, country);
+    address->country_code = contact_strdup(contact, country_code);
 
     return address;
 }
@@ -131,16 +176,15 @@ struct _EtiContactImUserId {
 };
 typedef struct _EtiContactImUserId EtiContactImUserId;
 
-static EtiContactImUserId *eti_contact_im_user_id_new(const char *service,
+static EtiContactImUserId *eti_contact_im_user_id_new(EtiContact *contact,
+                                                      const char *service,
                                                       const char *user_id)
 {
     EtiContactImUserId *im_user_id;
 
-    im_user_id = g_new0(EtiContactImUserId, 1);
-    if (service)
-        im_user_id->service = g_strdup(service);
-    if (user_id)
-        im_user_id->user_id = g_strdup(user_id);
+    im_user_id = contact_alloc0(contact, sizeof(EtiContactImUserId));
+    im_user_id->service = contact_strdup(contact, service);
+    im_user_id->user_id = contact_strdup(contact, user_id);
 
     return im_user_id;
 }
@@ -162,38 +206,56 @@ static void eti_contact_im_user_id_free(EtiContactImUserId *user_id)
 }
 
 
-static EtiContact *eti_contact_new_empty(void)
+static EtiContact *eti_contact_new_empty(EtiArena *arena)
 {
     EtiContact *contact;
 
-    contact = g_new0(EtiContact, 1);
+    if (arena == NULL)
+        return g_new0(EtiContact, 1);
+
+    contact = eti_arena_alloc0(arena, sizeof(EtiContact));
+    contact->arena = eti_arena_ref(arena);
 
     return contact;
 }
 
 EtiContact *eti_contact_new_person(const char *first_name,
                                    const char *last_name)
+{
+    return eti_contact_new_person_in_arena(NULL, first_name, last_name);
+}
+
+EtiContact *eti_contact_new_company(const char *company_name)
+{
+    return eti_contact_new_company_in_arena(NULL, company_name);
+}
+
+/* Contacts created in @arena, when not NULL, hold a reference on it and are
+ * cheap to free: apart from their photo and dates, everything they allocate
+ * goes away with the arena, once all of them have been freed.
+ */
+EtiContact *eti_contact_new_person_in_arena(EtiArena *arena,
+                                            const char *first_name,
+                                            const char *last_name)
 {
     EtiContact *contact;
 
-    contact = eti_contact_new_empty();
+    contact = eti_contact_new_empty(arena);
     contact->type = ETI_CONTACT_TYPE_PERSON;
-    if (NULL != first_name)
-        contact->first_name = g_strdup(first_name);
-    if (NULL != last_name)
-        contact->last_name = g_strdup(last_name);
+    contact->first_name = contact_strdup(contact, first_name);
+    contact->last_name = contact_strdup(contact, last_name);
 
     return contact;
 }
 
-EtiContact *eti_contact_new_company(const char *company_name)
+EtiContact *eti_contact_new_company_in_arena(EtiArena *arena,
+                                             const char *company_name)
 {
     EtiContact *contact;
 
-    contact = eti_contact_new_empty();
+    contact = eti_contact_new_empty(arena);
     contact->type = ETI_CONTACT_TYPE_COMPANY;
-    if (NULL != company_name)
-        contact->company_name = g_strdup(company_name);
+    contact->company_name = contact_strdup(contact, company_name);
 
     return contact;
 }
@@ -204,8 +266,8 @@ EtiContact *eti_contact_new_company(const char *company_name)
 {                                                               \
     if (NULL == fieldname)                                      \
         return;                                                 \
-    g_free(contact->fieldname);                                 \
-    contact->fieldname = g_strdup(fieldname);                   \
+    contact_release_str(contact, contact->fieldname);           \
+    contact->fieldname = contact_strdup(contact, fieldname);    \
 }
 
 ETI_CONTACT_SETTER(first_name);
@@ -231,22 +293,34 @@ void eti_contact_set_birthday(EtiContact *contact, GDateTime *birthday)
 void eti_contact_set_photo_from_data(EtiContact *contact,
                                      const guchar *data, gsize len)
 {
-    if (contact->photo.image_data != NULL)
-        g_free(contact->photo.image_data);
-
+    g_free(contact->photo.image_data);
     contact->photo.image_data = g_memdup(data, len);
     contact->photo.data_length = len;
 }
 
+void eti_contact_take_photo(EtiContact *contact, guchar *data, gsize len)
+{
+    g_free(contact->photo.image_data);
+    contact->photo.image_data = data;
+    contact->photo.data_length = len;
+}
+
 gboolean eti_contact_set_photo_from_file(EtiContact *contact,
                                          const char *filename,
                                          GError **error)
 {
-    if (contact->photo.image_data != NULL)
-        g_free(contact->photo.image_data);
+    gchar *data;
+    gsize len;
 
-    return g_file_get_contents(filename, (gchar **)&contact->photo.image_data,
-                               &contact->photo.data_length, error);
+    g_free(contact->photo.image_data);
+    contact->photo.image_data = NULL;
+    contact->photo.data_length = 0;
+    if (!g_file_get_contents(filename, &data, &len, error))
+        return FALSE;
+    contact->photo.image_data = (guchar *)data;
+    contact->photo.data_length = len;
+
+    return TRUE;
 }
 
 #define ETI_CONTACT_GETTER(fieldname) \
@@ -284,19 +358,28 @@ void eti_contact_get_photo(EtiContact *contact,
     *data_length = contact->photo.data_length;
 }
 
-static GList *generic_field_append(GList *fields, const char *type,
-                                   const char *label, gpointer data)
+/* @type, @label and @data must already belong to @contact */
+static GList *generic_field_prepend(EtiContact *contact, GList *fields,
+                                    char *type, char *label, gpointer data)
 {
     EtiContactGenericMultifield *field;
 
     g_assert(type != NULL);
-    field = g_new0(EtiContactGenericMultifield, 1);
-    field->type = g_strdup(type);
-    if (label)
-        field->label = g_strdup(label);
+    field = contact_alloc0(contact, sizeof(EtiContactGenericMultifield));
+    field->type = type;
+    field->label = label;
     field->value = data;
 
-    return g_list_prepend(fields, field);
+    return contact_list_prepend(contact, fields, field);
+}
+
+static GList *generic_field_append(EtiContact *contact, GList *fields,
+                                   const char *type, const char *label,
+                                   gpointer data)
+{
+    return generic_field_prepend(contact, fields,
+                                 contact_strdup(contact, type),
+                                 contact_strdup(contact, label), data);
 }
 
 void eti_contact_add_address(EtiContact *contact, const char *type,
@@ -306,10 +389,10 @@ void eti_contact_add_address(EtiContact *contact, const char *type,
 {
     EtiContactAddress *address;
 
-    address = eti_contact_address_new(street, postal_code, city,
+    address = eti_contact_address_new(contact, street, postal_code, city,
                                       country, country_code);
-    contact->addresses = generic_field_append(contact->addresses, type,
-                                              label, address);
+    contact->addresses = generic_field_append(contact, contact->addresses,
+                                              type, label, address);
 }
 
 void eti_contact_add_phone_number(EtiContact *contact,
@@ -319,9 +402,11 @@ void eti_contact_add_phone_number(EtiContact *contact,
 {
     if (phone_number == NULL)
         return;
-    contact->phone_numbers = generic_field_append(contact->phone_numbers,
+    contact->phone_numbers = generic_field_append(contact,
+                                                  contact->phone_numbers,
                                                   type, label,
-                                                  g_strdup(phone_number));
+                                                  contact_strdup(contact,
+                                                                 phone_number));
 }
 
 void eti_contact_add_email(EtiContact *contact,
@@ -331,8 +416,9 @@ void eti_contact_add_email(EtiContact *contact,
 {
     if (email == NULL)
         return;
-    contact->emails = generic_field_append(contact->emails, type,
-                                           label, g_strdup(email));
+    contact->emails = generic_field_append(contact, contact->emails, type,
+                                           label,
+                                           contact_strdup(contact, email));
 }
 
 void eti_contact_add_im_user_id(EtiContact *contact, const char *type,
@@ -343,8 +429,9 @@ void eti_contact_add_im_user_id(EtiContact *contact, const char *type,
 
     if (user_id == NULL)
         return;
-    im_user_id = eti_contact_im_user_id_new(service, user_id);
-    contact->im_user_ids = generic_field_append(contact->im_user_ids, type,
+    im_user_id = eti_contact_im_user_id_new(contact, service, user_id);
+    contact->im_user_ids = generic_field_append(contact,
+                                                contact->im_user_ids, type,
                                                 label, im_user_id);
 }
 
@@ -355,8 +442,8 @@ void eti_contact_add_url(EtiContact *contact,
 {
     if (url == NULL)
         return;
-    contact->urls = generic_field_append(contact->urls, type, label,
-                                         g_strdup(url));
+    contact->urls = generic_field_append(contact, contact->urls, type, label,
+                                         contact_strdup(contact, url));
 }
 
 void eti_contact_add_date(EtiContact *contact,
@@ -366,7 +453,8 @@ void eti_contact_add_date(EtiContact *contact,
 {
     if (date == NULL)
         return;
-    contact->dates = generic_field_append(contact->dates, type, label,
+    contact->dates = generic_field_append(contact, contact->dates, type,
+                                          label,
                                           g_date_time_ref(date));
 }
 
@@ -470,6 +558,227 @@ void eti_contact_foreach_im_user_id(EtiContact *contact,
     }
 }
 
+static void checksum_add_string(GChecksum *checksum, const char *str)
+{
+    /* the trailing NUL separates consecutive fields, NULL strings are
+     * hashed as a lone 0x01 byte so that they differ from empty ones
+     */
+    if (str == NULL)
+        g_checksum_update(checksum, (const guchar *)"\1", 1);
+    else
+        g_checksum_update(checksum, (const guchar *)str, strlen(str) + 1);
+}
+
+static void checksum_add_date(GChecksum *checksum, GDateTime *date)
+{
+    gint64 timestamp;
+
+    if (date == NULL) {
+        checksum_add_string(checksum, NULL);
+        return;
+    }
+    timestamp = g_date_time_to_unix(date);
+    g_checksum_update(checksum, (const guchar *)&timestamp, sizeof(timestamp));
+}
+
+static void checksum_generic_field(gpointer data, gpointer user_data)
+{
+    EtiContactGenericMultifield *field;
+    GChecksum *checksum;
+
+    field = (EtiContactGenericMultifield *)data;
+    checksum = (GChecksum *)user_data;
+
+    checksum_add_string(checksum, field->type);
+    checksum_add_string(checksum, field->label);
+    checksum_add_string(checksum, field->value);
+}
+
+static void checksum_address(gpointer data, gpointer user_data)
+{
+    EtiContactGenericMultifield *field;
+    EtiContactAddress *address;
+    GChecksum *checksum;
+
+    field = (EtiContactGenericMultifield *)data;
+    address = (EtiContactAddress *)field->value;
+    checksum = (GChecksum *)user_data;
+
+    checksum_add_string(checksum, field->type);
+    checksum_add_string(checksum, field->label);
+    checksum_add_string(checksum, address->street);
+    checksum_add_string(checksum, address->postal_code);
+    checksum_add_string(checksum, address->city);
+    checksum_add_string(checksum, address->country);
+    checksum_add_string(checksum, address->country_code);
+}
+
+static void checksum_im_user_id(gpointer data, gpointer user_data)
+{
+    EtiContactGenericMultifield *field;
+    EtiContactImUserId *im_user_id;
+    GChecksum *checksum;
+
+    field = (EtiContactGenericMultifield *)data;
+    im_user_id = (EtiContactImUserId *)field->value;
+    checksum = (GChecksum *)user_data;
+
+    checksum_add_string(checksum, field->type);
+    checksum_add_string(checksum, field->label);
+    checksum_add_string(checksum, im_user_id->service);
+    checksum_add_string(checksum, im_user_id->user_id);
+}
+
+static void checksum_date(gpointer data, gpointer user_data)
+{
+    EtiContactGenericMultifield *field;
+    GChecksum *checksum;
+
+    field = (EtiContactGenericMultifield *)data;
+    checksum = (GChecksum *)user_data;
+
+    checksum_add_string(checksum, field->type);
+    checksum_add_string(checksum, field->label);
+    checksum_add_date(checksum, (GDateTime *)field->value);
+}
+
+/* Returns a digest of everything that ends up being sent to the device for
+ * this contact, this is used to find out which contacts changed between 2
+ * synchronizations. The list separators make sure that a field moving from
+ * one list to the next one changes the fingerprint.
+ */
+gchar *eti_contact_get_fingerprint(EtiContact *contact)
+{
+    GChecksum *checksum;
+    gchar *fingerprint;
+    guchar type;
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    type = contact->type;
+    g_checksum_update(checksum, &type, 1);
+    checksum_add_string(checksum, contact->first_name);
+    checksum_add_string(checksum, contact->first_name_yomi);
+    checksum_add_string(checksum, contact->middle_name);
+    checksum_add_string(checksum, contact->last_name);
+    checksum_add_string(checksum, contact->last_name_yomi);
+    checksum_add_string(checksum, contact->nickname);
+    checksum_add_string(checksum, contact->title);
+    checksum_add_string(checksum, contact->name_suffix);
+    checksum_add_string(checksum, contact->notes);
+    checksum_add_string(checksum, contact->company_name);
+    checksum_add_string(checksum, contact->department);
+    checksum_add_string(checksum, contact->job_title);
+    checksum_add_date(checksum, contact->birthday);
+    g_checksum_update(checksum, (const guchar *)&contact->photo.data_length,
+                      sizeof(contact->photo.data_length));
+    if (contact->photo.image_data != NULL)
+        g_checksum_update(checksum, contact->photo.image_data,
+                          contact->photo.data_length);
+
+    g_list_foreach(contact->addresses, checksum_address, checksum);
+    checksum_add_string(checksum, NULL);
+    g_list_foreach(contact->phone_numbers, checksum_generic_field, checksum);
+    checksum_add_string(checksum, NULL);
+    g_list_foreach(contact->emails, checksum_generic_field, checksum);
+    checksum_add_string(checksum, NULL);
+    g_list_foreach(contact->im_user_ids, checksum_im_user_id, checksum);
+    checksum_add_string(checksum, NULL);
+    g_list_foreach(contact->urls, checksum_generic_field, checksum);
+    checksum_add_string(checksum, NULL);
+    g_list_foreach(contact->dates, checksum_date, checksum);
+
+    fingerprint = g_strdup(g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+
+    return fingerprint;
+}
+
+static gsize str_size(const char *str)
+{
+    if (str == NULL)
+        return 0;
+
+    return strlen(str);
+}
+
+static void add_generic_field_size(gpointer data, gpointer user_data)
+{
+    EtiContactGenericMultifield *field;
+    gsize *size;
+
+    field = (EtiContactGenericMultifield *)data;
+    size = (gsize *)user_data;
+
+    *size += str_size(field->type) + str_size(field->label);
+}
+
+static void add_string_field_size(gpointer data, gpointer user_data)
+{
+    EtiContactGenericMultifield *field;
+
+    add_generic_field_size(data, user_data);
+    field = (EtiContactGenericMultifield *)data;
+    *(gsize *)user_data += str_size(field->value);
+}
+
+static void add_address_size(gpointer data, gpointer user_data)
+{
+    EtiContactGenericMultifield *field;
+    EtiContactAddress *address;
+
+    add_generic_field_size(data, user_data);
+    field = (EtiContactGenericMultifield *)data;
+    address = (EtiContactAddress *)field->value;
+    *(gsize *)user_data += str_size(address->street)
+                           + str_size(address->postal_code)
+                           + str_size(address->city)
+                           + str_size(address->country)
+                           + str_size(address->country_code);
+}
+
+static void add_im_user_id_size(gpointer data, gpointer user_data)
+{
+    EtiContactGenericMultifield *field;
+    EtiContactImUserId *im_user_id;
+
+    add_generic_field_size(data, user_data);
+    field = (EtiContactGenericMultifield *)data;
+    im_user_id = (EtiContactImUserId *)field->value;
+    *(gsize *)user_data += str_size(im_user_id->service)
+                           + str_size(im_user_id->user_id);
+}
+
+/* Approximate number of bytes of contact data which will be sent to the
+ * device for this contact, plist encoding overhead isn't taken into account
+ */
+gsize eti_contact_get_data_size(EtiContact *contact)
+{
+    gsize size;
+
+    size = str_size(contact->first_name)
+           + str_size(contact->first_name_yomi)
+           + str_size(contact->middle_name)
+           + str_size(contact->last_name)
+           + str_size(contact->last_name_yomi)
+           + str_size(contact->nickname)
+           + str_size(contact->title)
+           + str_size(contact->name_suffix)
+           + str_size(contact->notes)
+           + str_size(contact->company_name)
+           + str_size(contact->department)
+           + str_size(contact->job_title)
+           + contact->photo.data_length;
+
+    g_list_foreach(contact->addresses, add_address_size, &size);
+    g_list_foreach(contact->phone_numbers, add_string_field_size, &size);
+    g_list_foreach(contact->emails, add_string_field_size, &size);
+    g_list_foreach(contact->im_user_ids, add_im_user_id_size, &size);
+    g_list_foreach(contact->urls, add_string_field_size, &size);
+    g_list_foreach(contact->dates, add_generic_field_size, &size);
+
+    return size;
+}
+
 static void generic_field_free(gpointer data, gpointer user_data)
 {
     EtiContactGenericMultifield *field;
@@ -485,8 +794,26 @@ static void generic_field_free(gpointer data, gpointer user_data)
     g_free(field);
 }
 
+static void unref_date(gpointer data, gpointer user_data)
+{
+    EtiContactGenericMultifield *field;
+
+    field = (EtiContactGenericMultifield *)data;
+    g_date_time_unref(field->value);
+}
+
 void eti_contact_free(EtiContact *contact)
 {
+    if (contact->arena != NULL) {
+        /* the contact itself lives in the arena */
+        g_list_foreach(contact->dates, unref_date, NULL);
+        g_free(contact->photo.image_data);
+        if (contact->birthday != NULL)
+            g_date_time_unref(contact->birthday);
+        eti_arena_unref(contact->arena);
+        return;
+    }
+
     g_list_foreach(contact->addresses, generic_field_free,
                    eti_contact_address_free);
     g_list_free(contact->addresses);
@@ -20,6 +20,8 @@
 
 #include <glib-2.0/glib.h>
 
+#include "eti-arena.h"
+
 
 typedef struct _EtiContact EtiContact;
 
@@ -41,6 +43,11 @@ GQuark eti_contact_error_quark(void);
 EtiContact *eti_contact_new_person(const char *first_name,
                                    const char *last_name);
 EtiContact *eti_contact_new_company(const char *company_name);
+EtiContact *eti_contact_new_person_in_arena(EtiArena *arena,
+                                            const char *first_name,
+                                            const char *last_name);
+EtiContact *eti_contact_new_company_in_arena(EtiArena *arena,
+                                             const char *company_name);
 void eti_contact_set_first_name(EtiContact *contact, const char *first_name);
 void eti_contact_set_first_name_yomi(EtiContact *contact,
                                      const char *first_name_yomi);
@@ -62,6 +69,12 @@ void eti_contact_set_photo_from_data(EtiContact *contact,
 gboolean eti_contact_set_photo_from_file(EtiContact *contact,
                                          const char *filename,
                                          GError **error);
+/* Same as eti_contact_set_photo_from_data() but @data is owned by @contact
+ * afterwards. It can come from g_malloc() or, like what libplist returns,
+ * from malloc(): since GLib 2.46, which configure requires for this reason,
+ * g_free() and free() are interchangeable.
+ */
+void eti_contact_take_photo(EtiContact *contact, guchar *data, gsize len);
 
 void eti_contact_add_address(EtiContact *contact, const char *type,
                              const char *label, const char *street,
@@ -140,6 +153,9 @@ void eti_contact_foreach_im_user_id(EtiContact *contact,
                                     EtiContactImUserIdIterator iter_func,
                                     gpointer user_data);
 
+gchar *eti_contact_get_fingerprint(EtiContact *contact);
+gsize eti_contact_get_data_size(EtiContact *contact);
+
 void eti_contact_free(EtiContact *contact);
 void eti_contact_dump(EtiContact *contact);
 #endif
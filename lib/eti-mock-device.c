@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "eti-mock-device.h"
+#include "eti-sync.h"
+#include "eti-sync-transport.h"
+
+#include <glib-2.0/glib.h>
+#include <plist/plist.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* In-process stand-in for the com.apple.mobilesync service of a device,
+ * to run and benchmark synchronizations without a phone. It keeps its
+ * records in memory, initially loaded from a fixture: a plist file with
+ * the same content as what a device sends for a slow sync (record ID ->
+ * record). New records are given "mock-<n>" IDs, records sent as a string
+ * are deleted. Every message exchanged with the device is delayed by the
+ * configured latency.
+ */
+#define ETI_MOCK_DEVICE_RECORDS_PER_MESSAGE 100
+
+struct MockDevice {
+    EtiSyncTransport parent;
+    plist_t records;
+    char *anchor;
+    char *next_anchor;
+    GQueue *outgoing;
+    plist_t remapped;
+    guint next_id;
+    gulong latency;
+};
+
+static struct MockDevice *get_device(EtiSyncTransport *transport)
+{
+    return (struct MockDevice *)transport;
+}
+
+static void simulate_latency(struct MockDevice *device)
+{
+    if (device->latency != 0)
+        g_usleep(device->latency);
+}
+
+static mobilesync_error_t mock_start(EtiSyncTransport *transport,
+                                     const char *data_class,
+                                     mobilesync_anchors_t anchors,
+                                     uint64_t computer_data_class_version,
+                                     mobilesync_sync_type_t *sync_type,
+                                     uint64_t *device_data_class_version,
+                                     char **error_description)
+{
+    struct MockDevice *device = get_device(transport);
+
+    simulate_latency(device);
+    if ((device->anchor != NULL)
+            && (g_strcmp0(anchors->device_anchor, device->anchor) == 0))
+        *sync_type = MOBILESYNC_SYNC_TYPE_FAST;
+    else
+        *sync_type = MOBILESYNC_SYNC_TYPE_SLOW;
+    *device_data_class_version = computer_data_class_version;
+    g_free(device->next_anchor);
+    device->next_anchor = g_strdup(anchors->computer_anchor);
+
+    return MOBILESYNC_E_SUCCESS;
+}
+
+static void queue_records(struct MockDevice *device, gboolean all_records)
+{
+    plist_dict_iter iter = NULL;
+    char *key = NULL;
+    plist_t node = NULL;
+    plist_t message;
+
+    message = plist_new_dict();
+    if (all_records)
+        plist_dict_new_iter(device->records, &iter);
+    if (iter != NULL) {
+        plist_dict_next_item(device->records, iter, &key, &node);
+        while (node != NULL) {
+            if (plist_dict_get_size(message) == ETI_MOCK_DEVICE_RECORDS_PER_MESSAGE) {
+                g_queue_push_tail(device->outgoing, message);
+                message = plist_new_dict();
+            }
+            plist_dict_set_item(message, key, plist_copy(node));
+            free(key);
+            key = NULL;
+            plist_dict_next_item(device->records, iter, &key, &node);
+        }
+        free(iter);
+    }
+    /* nothing changes on our side, fast syncs get an empty message */
+    g_queue_push_tail(device->outgoing, message);
+}
+
+static mobilesync_error_t mock_get_all_records(EtiSyncTransport *transport)
+{
+    simulate_latency(get_device(transport));
+    queue_records(get_device(transport), TRUE);
+
+    return MOBILESYNC_E_SUCCESS;
+}
+
+static mobilesync_error_t mock_get_changes(EtiSyncTransport *transport)
+{
+    simulate_latency(get_device(transport));
+    queue_records(get_device(transport), FALSE);
+
+    return MOBILESYNC_E_SUCCESS;
+}
+
+static mobilesync_error_t mock_receive_changes(EtiSyncTransport *transport,
+                                               plist_t *entities,
+                                               uint8_t *is_last_record)
+{
+    struct MockDevice *device = get_device(transport);
+
+    simulate_latency(device);
+    if (g_queue_is_empty(device->outgoing))
+        return MOBILESYNC_E_WRONG_DIRECTION;
+
+    *entities = g_queue_pop_head(device->outgoing);
+    *is_last_record = g_queue_is_empty(device->outgoing);
+
+    return MOBILESYNC_E_SUCCESS;
+}
+
+static mobilesync_error_t mock_acknowledge(EtiSyncTransport *transport)
+{
+    simulate_latency(get_device(transport));
+
+    return MOBILESYNC_E_SUCCESS;
+}
+
+static mobilesync_error_t mock_ready_to_send(EtiSyncTransport *transport)
+{
+    struct MockDevice *device = get_device(transport);
+
+    simulate_latency(device);
+    if (!g_queue_is_empty(device->outgoing))
+        return MOBILESYNC_E_WRONG_DIRECTION;
+
+    return MOBILESYNC_E_SUCCESS;
+}
+
+static mobilesync_error_t mock_send_changes(EtiSyncTransport *transport,
+                                            plist_t entities,
+                                            uint8_t is_last_record)
+{
+    struct MockDevice *device = get_device(transport);
+    plist_dict_iter iter = NULL;
+    char *key = NULL;
+    plist_t node = NULL;
+
+    simulate_latency(device);
+    if ((entities == NULL) || (plist_get_node_type(entities) != PLIST_DICT))
+        return MOBILESYNC_E_INVALID_ARG;
+
+    if (device->remapped != NULL)
+        plist_free(device->remapped);
+    device->remapped = plist_new_dict();
+
+    plist_dict_new_iter(entities, &iter);
+    if (iter == NULL)
+        return MOBILESYNC_E_SUCCESS;
+    plist_dict_next_item(entities, iter, &key, &node);
+    while (node != NULL) {
+        if (plist_get_node_type(node) != PLIST_DICT) {
+            plist_dict_remove_item(device->records, key);
+        } else if (plist_dict_get_item(device->records, key) != NULL) {
+            plist_dict_set_item(device->records, key, plist_copy(node));
+        } else {
+            char *id;
+
+            id = g_strdup_printf("mock-%u", device->next_id++);
+            plist_dict_set_item(device->records, id, plist_copy(node));
+            plist_dict_set_item(device->remapped, key, plist_new_string(id));
+            g_free(id);
+        }
+        free(key);
+        key = NULL;
+        plist_dict_next_item(entities, iter, &key, &node);
+    }
+    free(iter);
+
+    return MOBILESYNC_E_SUCCESS;
+}
+
+static mobilesync_error_t mock_remap_identifiers(EtiSyncTransport *transport,
+                                                 plist_t *mapping)
+{
+    struct MockDevice *device = get_device(transport);
+
+    simulate_latency(device);
+    *mapping = device->remapped;
+    device->remapped = NULL;
+
+    return MOBILESYNC_E_SUCCESS;
+}
+
+static mobilesync_error_t mock_clear_all(EtiSyncTransport *transport)
+{
+    struct MockDevice *device = get_device(transport);
+
+    simulate_latency(device);
+    plist_free(device->records);
+    device->records = plist_new_dict();
+
+    return MOBILESYNC_E_SUCCESS;
+}
+
+static mobilesync_error_t mock_finish(EtiSyncTransport *transport)
+{
+    struct MockDevice *device = get_device(transport);
+
+    simulate_latency(device);
+    g_free(device->anchor);
+    device->anchor = device->next_anchor;
+    device->next_anchor = NULL;
+
+    return MOBILESYNC_E_SUCCESS;
+}
+
+static void mock_free(EtiSyncTransport *transport)
+{
+    struct MockDevice *device = get_device(transport);
+
+    plist_free(device->records);
+    if (device->remapped != NULL)
+        plist_free(device->remapped);
+    g_queue_free_full(device->outgoing, (GDestroyNotify)plist_free);
+    g_free(device->anchor);
+    g_free(device->next_anchor);
+    g_free(device);
+}
+
+static plist_t load_fixture(const char *fixture, GError **error)
+{
+    char *contents;
+    gsize length;
+    plist_t records;
+
+    if (!g_file_get_contents(fixture, &contents, &length, error))
+        return NULL;
+
+    records = NULL;
+    if ((length >= 6) && (memcmp(contents, "bplist", 6) == 0))
+        plist_from_bin(contents, length, &records);
+    else
+        plist_from_xml(contents, length, &records);
+    g_free(contents);
+    if ((records == NULL) || (plist_get_node_type(records) != PLIST_DICT)) {
+        g_set_error(error, ETI_SYNC_ERROR, ETI_SYNC_ERROR_READING,
+                    "%s is not a plist dictionary of device records",
+                    fixture);
+        if (records != NULL)
+            plist_free(records);
+        return NULL;
+    }
+
+    return records;
+}
+
+/* @fixture can be NULL for a device without contacts */
+EtiSyncTransport *eti_mock_device_new(const char *fixture,
+                                      guint latency_ms,
+                                      GError **error)
+{
+    struct MockDevice *device;
+    plist_t records;
+
+    if (fixture != NULL) {
+        records = load_fixture(fixture, error);
+        if (records == NULL)
+            return NULL;
+    } else {
+        records = plist_new_dict();
+    }
+
+    device = g_new0(struct MockDevice, 1);
+    device->records = records;
+    device->outgoing = g_queue_new();
+    device->latency = latency_ms * 1000;
+
+    device->parent.start = mock_start;
+    device->parent.get_all_records_from_device = mock_get_all_records;
+    device->parent.get_changes_from_device = mock_get_changes;
+    device->parent.receive_changes = mock_receive_changes;
+    device->parent.acknowledge_changes_from_device = mock_acknowledge;
+    device->parent.ready_to_send_changes_from_computer = mock_ready_to_send;
+    device->parent.send_changes = mock_send_changes;
+    device->parent.remap_identifiers = mock_remap_identifiers;
+    device->parent.clear_all_records_on_device = mock_clear_all;
+    device->parent.finish = mock_finish;
+    device->parent.free = mock_free;
+
+    return (EtiSyncTransport *)device;
+}
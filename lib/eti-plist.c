@@ -15,7 +15,12 @@
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include "eti-plist.h"
+#include <stdlib.h>
 
 static gboolean eti_enable_dump_xml = FALSE;
 
@@ -37,21 +42,38 @@ void eti_plist_dump(plist_t plist)
     }
 }
 
+/* Size of the binary serialization of @plist, which is what is exchanged
+ * with the device
+ */
+gsize eti_plist_get_size(plist_t plist)
+{
+    uint32_t len = 0;
+    char *bin = NULL;
+
+    if (plist == NULL)
+        return 0;
+
+    plist_to_bin(plist, &bin, &len);
+    free(bin);
+
+    return len;
+}
+
+/* Converting with ETI_PLIST_APPLE_EPOCH_OFFSET rather than with a GDateTime
+ * for the Apple epoch saves allocations on every date.
+ */
 void eti_plist_dict_set_date(plist_t dict, const char *key, GDateTime *date)
 {
-    GDateTime *epoch;
-    GTimeSpan timespan;
+    gint64 secs;
 
     if (date == NULL)
         return;
 
-    epoch = g_date_time_new_utc(2001, 1, 1, 0, 0, 0);
-    timespan = g_date_time_difference(date, epoch);
+    secs = g_date_time_to_unix(date) - ETI_PLIST_APPLE_EPOCH_OFFSET;
 	/* FIXME plist_dict_insert_item’ is deprecated: use plist_dict_set_item instead TW 10/01/16 */
     plist_dict_set_item(dict, key,
-                           plist_new_date(timespan/G_TIME_SPAN_SECOND,
-                                          timespan%G_TIME_SPAN_SECOND));
-    g_date_time_unref(epoch);
+                           plist_new_date(secs,
+                                          g_date_time_get_microsecond(date)));
 }
 
 GDateTime *eti_plist_dict_get_date(plist_t node, const char *key)
@@ -71,12 +93,13 @@ GDateTime *eti_plist_dict_get_date(plist_t node, const char *key)
         return NULL;
 
     plist_get_date_val(value, &secs, &usecs);
-    tmp_date = g_date_time_new_utc(2001, 1, 1, 0, 0, 0);
-    date = g_date_time_add_seconds(tmp_date, secs);
-    g_date_time_unref(tmp_date);
-    tmp_date = date;
-    date = g_date_time_add_seconds(tmp_date, (double)usecs/1000000.0);
-    g_date_time_unref(tmp_date);
+    date = g_date_time_new_from_unix_utc(secs + ETI_PLIST_APPLE_EPOCH_OFFSET);
+    /* contact dates are whole days, this is almost never needed */
+    if ((date != NULL) && (usecs != 0)) {
+        tmp_date = date;
+        date = g_date_time_add(tmp_date, usecs);
+        g_date_time_unref(tmp_date);
+    }
 
     return date;
 }
@@ -107,6 +130,33 @@ char *eti_plist_dict_get_string(plist_t node, const char *key)
     return value_str;
 }
 
+/* Same as eti_plist_dict_get_string() but avoids copying the string when
+ * libplist can hand out a pointer to it. *@copy is set to what must be
+ * released with free() once the returned string isn't needed anymore.
+ */
+const char *eti_plist_dict_peek_string(plist_t node, const char *key,
+                                       char **copy)
+{
+#ifdef HAVE_PLIST_GET_STRING_PTR
+    plist_t value;
+
+    *copy = NULL;
+    if (plist_get_node_type(node) != PLIST_DICT)
+        return NULL;
+    value = plist_dict_get_item(node, key);
+    if (value == NULL)
+        return NULL;
+    if (plist_get_node_type(value) != PLIST_STRING)
+        return NULL;
+
+    return plist_get_string_ptr(value, NULL);
+#else
+    *copy = eti_plist_dict_get_string(node, key);
+
+    return *copy;
+#endif
+}
+
 void eti_plist_dict_set_data(plist_t dict, const char *key,
                              const guchar *data, gsize len)
 {
@@ -21,14 +21,22 @@
 #include <glib-2.0/glib.h>
 #include <plist/plist.h>
 
+/* Dates in plists are relative to 2001-01-01 00:00:00 UTC, this is how far
+ * it is from the Unix epoch, in seconds
+ */
+#define ETI_PLIST_APPLE_EPOCH_OFFSET G_GINT64_CONSTANT(978307200)
+
 void eti_plist_set_debug(gboolean enable_debug);
 void eti_plist_dump(plist_t plist);
+gsize eti_plist_get_size(plist_t plist);
 void eti_plist_dict_set_date(plist_t dict, const char *key, GDateTime *date);
 GDateTime *eti_plist_dict_get_date(plist_t node, const char *key);
 void eti_plist_dict_set_string(plist_t dict,
                                const char *key,
                                const char *value);
 char *eti_plist_dict_get_string(plist_t node, const char *key);
+const char *eti_plist_dict_peek_string(plist_t node, const char *key,
+                                       char **copy);
 void eti_plist_dict_set_data(plist_t dict, const char *key,
                              const guchar *data, gsize len);
 guchar *eti_plist_dict_get_data(plist_t node, const char *key, guint64 *len);
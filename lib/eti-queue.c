@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "eti-queue.h"
+
+#include <glib-2.0/glib.h>
+
+/* Bounded producer/consumer queue: eti_queue_push() blocks while the queue
+ * is full, eti_queue_pop() blocks while it's empty. Once closed, pushes
+ * fail and pops return the remaining items then NULL, NULL items can't be
+ * queued.
+ */
+struct _EtiQueue {
+    GMutex lock;
+    GCond cond;
+    GList *head;
+    GList *tail;
+    guint length;
+    guint max_length;
+    gboolean closed;
+    GDestroyNotify free_func;
+};
+
+EtiQueue *eti_queue_new(guint max_length, GDestroyNotify free_func)
+{
+    EtiQueue *queue;
+
+    g_return_val_if_fail(max_length > 0, NULL);
+
+    queue = g_new0(EtiQueue, 1);
+    g_mutex_init(&queue->lock);
+    g_cond_init(&queue->cond);
+    queue->max_length = max_length;
+    queue->free_func = free_func;
+
+    return queue;
+}
+
+gboolean eti_queue_push(EtiQueue *queue, gpointer data)
+{
+    GList *link;
+
+    g_return_val_if_fail(data != NULL, FALSE);
+
+    g_mutex_lock(&queue->lock);
+    while (!queue->closed && (queue->length >= queue->max_length))
+        g_cond_wait(&queue->cond, &queue->lock);
+    if (queue->closed) {
+        g_mutex_unlock(&queue->lock);
+        return FALSE;
+    }
+
+    link = g_list_append(NULL, data);
+    if (queue->tail != NULL) {
+        queue->tail->next = link;
+        link->prev = queue->tail;
+    } else {
+        queue->head = link;
+    }
+    queue->tail = link;
+    queue->length++;
+    g_cond_broadcast(&queue->cond);
+    g_mutex_unlock(&queue->lock);
+
+    return TRUE;
+}
+
+gpointer eti_queue_pop(EtiQueue *queue)
+{
+    gpointer data;
+
+    g_mutex_lock(&queue->lock);
+    while (!queue->closed && (queue->head == NULL))
+        g_cond_wait(&queue->cond, &queue->lock);
+    if (queue->head == NULL) {
+        g_mutex_unlock(&queue->lock);
+        return NULL;
+    }
+
+    data = queue->head->data;
+    queue->head = g_list_delete_link(queue->head, queue->head);
+    if (queue->head == NULL)
+        queue->tail = NULL;
+    queue->length--;
+    g_cond_broadcast(&queue->cond);
+    g_mutex_unlock(&queue->lock);
+
+    return data;
+}
+
+void eti_queue_close(EtiQueue *queue)
+{
+    g_mutex_lock(&queue->lock);
+    queue->closed = TRUE;
+    g_cond_broadcast(&queue->cond);
+    g_mutex_unlock(&queue->lock);
+}
+
+/* Must only be called once the producer and the consumer are done with the
+ * queue, items which are still queued are destroyed.
+ */
+void eti_queue_free(EtiQueue *queue)
+{
+    if (queue->free_func != NULL)
+        g_list_foreach(queue->head, (GFunc)queue->free_func, NULL);
+    g_list_free(queue->head);
+    g_cond_clear(&queue->cond);
+    g_mutex_clear(&queue->lock);
+    g_free(queue);
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef ETI_QUEUE_H
+#define ETI_QUEUE_H
+
+#include <glib-2.0/glib.h>
+
+typedef struct _EtiQueue EtiQueue;
+
+EtiQueue *eti_queue_new(guint max_length, GDestroyNotify free_func);
+gboolean eti_queue_push(EtiQueue *queue, gpointer data);
+gpointer eti_queue_pop(EtiQueue *queue);
+void eti_queue_close(EtiQueue *queue);
+void eti_queue_free(EtiQueue *queue);
+
+#endif
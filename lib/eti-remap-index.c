@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "eti-remap-index.h"
+
+#include <glib-2.0/glib.h>
+#include <plist/plist.h>
+#include <stdlib.h>
+
+/* Maps the record IDs we sent to the device to the IDs the device assigned
+ * to them. The remapped identifiers plists returned by the device are
+ * converted once when they are received, lookups then don't need to copy
+ * anything out of libplist.
+ */
+struct _EtiRemapIndex {
+    GHashTable *ids;
+};
+
+EtiRemapIndex *eti_remap_index_new(void)
+{
+    EtiRemapIndex *index;
+
+    index = g_new0(EtiRemapIndex, 1);
+    index->ids = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                       g_free, g_free);
+
+    return index;
+}
+
+void eti_remap_index_free(EtiRemapIndex *index)
+{
+    g_hash_table_destroy(index->ids);
+    g_free(index);
+}
+
+void eti_remap_index_insert(EtiRemapIndex *index, const char *uid,
+                            const char *device_id)
+{
+    g_hash_table_replace(index->ids, g_strdup(uid), g_strdup(device_id));
+}
+
+void eti_remap_index_add_plist(EtiRemapIndex *index, plist_t remapped_uids)
+{
+    plist_dict_iter iter;
+    char *key;
+    plist_t node;
+
+    if ((remapped_uids == NULL)
+            || (plist_get_node_type(remapped_uids) != PLIST_DICT))
+        return;
+
+    iter = NULL;
+    plist_dict_new_iter(remapped_uids, &iter);
+    if (iter == NULL)
+        return;
+
+    key = NULL;
+    node = NULL;
+    plist_dict_next_item(remapped_uids, iter, &key, &node);
+    while (node) {
+        if (plist_get_node_type(node) == PLIST_STRING) {
+            char *device_id;
+
+            plist_get_string_val(node, &device_id);
+            eti_remap_index_insert(index, key, device_id);
+            free(device_id);
+        }
+        free(key);
+        key = NULL;
+        plist_dict_next_item(remapped_uids, iter, &key, &node);
+    }
+    free(iter);
+}
+
+const char *eti_remap_index_lookup(EtiRemapIndex *index, const char *uid)
+{
+    if (index == NULL)
+        return NULL;
+
+    return g_hash_table_lookup(index->ids, uid);
+}
+
+void eti_remap_index_remove(EtiRemapIndex *index, const char *uid)
+{
+    g_hash_table_remove(index->ids, uid);
+}
+
+/* @func gets the ID we sent and the ID the device remapped it to, it must
+ * not modify @index
+ */
+void eti_remap_index_foreach(EtiRemapIndex *index, GHFunc func,
+                             gpointer user_data)
+{
+    g_hash_table_foreach(index->ids, func, user_data);
+}
+
+guint eti_remap_index_size(EtiRemapIndex *index)
+{
+    return g_hash_table_size(index->ids);
+}
+
+plist_t eti_remap_index_to_plist(EtiRemapIndex *index)
+{
+    plist_t dict;
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+
+    dict = plist_new_dict();
+    g_hash_table_iter_init(&iter, index->ids);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        plist_dict_set_item(dict, key, plist_new_string(value));
+
+    return dict;
+}
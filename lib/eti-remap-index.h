@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef ETI_REMAP_INDEX_H
+#define ETI_REMAP_INDEX_H
+
+#include <glib-2.0/glib.h>
+#include <plist/plist.h>
+
+typedef struct _EtiRemapIndex EtiRemapIndex;
+
+EtiRemapIndex *eti_remap_index_new(void);
+void eti_remap_index_free(EtiRemapIndex *index);
+void eti_remap_index_insert(EtiRemapIndex *index, const char *uid,
+                            const char *device_id);
+void eti_remap_index_add_plist(EtiRemapIndex *index, plist_t remapped_uids);
+const char *eti_remap_index_lookup(EtiRemapIndex *index, const char *uid);
+void eti_remap_index_remove(EtiRemapIndex *index, const char *uid);
+void eti_remap_index_foreach(EtiRemapIndex *index, GHFunc func,
+                             gpointer user_data);
+guint eti_remap_index_size(EtiRemapIndex *index);
+plist_t eti_remap_index_to_plist(EtiRemapIndex *index);
+
+#endif
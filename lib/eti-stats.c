@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "eti-stats.h"
+
+#include <glib-2.0/glib.h>
+#include <string.h>
+
+/* Time spent and amount of data processed by each phase of a run. A phase
+ * can run several times (eg one send per batch), in which case its
+ * counters are summed. Phases are reported in the order they first ran.
+ * EtiStats isn't thread-safe, workers must report their counters to the
+ * thread which owns it.
+ */
+struct _EtiStats {
+    GPtrArray *phases;
+    gboolean measure_bytes;
+};
+
+struct Phase {
+    char *name;
+    guint calls;
+    gint64 usecs;
+    gint64 max_usecs;
+    guint records;
+    gsize bytes;
+};
+
+static void phase_free(struct Phase *phase)
+{
+    g_free(phase->name);
+    g_free(phase);
+}
+
+EtiStats *eti_stats_new(void)
+{
+    EtiStats *stats;
+
+    stats = g_new0(EtiStats, 1);
+    stats->phases = g_ptr_array_new_with_free_func((GDestroyNotify)phase_free);
+
+    return stats;
+}
+
+void eti_stats_free(EtiStats *stats)
+{
+    g_ptr_array_free(stats->phases, TRUE);
+    g_free(stats);
+}
+
+/* Counting bytes means serializing what is sent or received one more time,
+ * this is only done when asked for
+ */
+void eti_stats_set_measure_bytes(EtiStats *stats, gboolean measure_bytes)
+{
+    stats->measure_bytes = measure_bytes;
+}
+
+gboolean eti_stats_get_measure_bytes(EtiStats *stats)
+{
+    return stats->measure_bytes;
+}
+
+static struct Phase *get_phase(EtiStats *stats, const char *name)
+{
+    struct Phase *phase;
+    guint i;
+
+    for (i = 0; i < stats->phases->len; i++) {
+        phase = g_ptr_array_index(stats->phases, i);
+        if (strcmp(phase->name, name) == 0)
+            return phase;
+    }
+
+    phase = g_new0(struct Phase, 1);
+    phase->name = g_strdup(name);
+    g_ptr_array_add(stats->phases, phase);
+
+    return phase;
+}
+
+void eti_stats_add(EtiStats *stats, const char *phase_name, gint64 usecs,
+                   guint records, gsize bytes)
+{
+    struct Phase *phase;
+
+    phase = get_phase(stats, phase_name);
+    phase->calls++;
+    phase->usecs += usecs;
+    phase->max_usecs = MAX(phase->max_usecs, usecs);
+    phase->records += records;
+    phase->bytes += bytes;
+}
+
+/* Returns a human readable table */
+gchar *eti_stats_format(EtiStats *stats, const char *title)
+{
+    GString *table;
+    guint i;
+
+    table = g_string_new(NULL);
+    g_string_append_printf(table, "%s\n", title);
+    g_string_append_printf(table,
+                           "  %-24s %6s %10s %10s %8s %10s %10s\n",
+                           "phase", "calls", "total ms", "max ms",
+                           "records", "kB", "records/s");
+    for (i = 0; i < stats->phases->len; i++) {
+        struct Phase *phase = g_ptr_array_index(stats->phases, i);
+        gdouble rate;
+
+        rate = 0;
+        if (phase->usecs > 0)
+            rate = (gdouble)phase->records * G_USEC_PER_SEC / phase->usecs;
+        g_string_append_printf(table,
+                               "  %-24s %6u %10.1f %10.1f %8u %10.1f %10.0f\n",
+                               phase->name, phase->calls,
+                               phase->usecs / 1000.0,
+                               phase->max_usecs / 1000.0,
+                               phase->records, phase->bytes / 1024.0, rate);
+    }
+
+    return g_string_free(table, FALSE);
+}
+
+/* Returns a JSON object with one member per phase */
+gchar *eti_stats_to_json(EtiStats *stats)
+{
+    GString *json;
+    guint i;
+
+    json = g_string_new("{");
+    for (i = 0; i < stats->phases->len; i++) {
+        struct Phase *phase = g_ptr_array_index(stats->phases, i);
+
+        /* phase names are literals from our code, no escaping needed */
+        g_string_append_printf(json,
+                               "%s\"%s\": { \"calls\": %u, "
+                               "\"total_us\": %"G_GINT64_FORMAT", "
+                               "\"max_us\": %"G_GINT64_FORMAT", "
+                               "\"records\": %u, "
+                               "\"bytes\": %"G_GSIZE_FORMAT" }",
+                               (i == 0)?" ":", ", phase->name, phase->calls,
+                               phase->usecs, phase->max_usecs,
+                               phase->records, phase->bytes);
+    }
+    g_string_append(json, " }");
+
+    return g_string_free(json, FALSE);
+}
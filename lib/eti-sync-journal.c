@@ -0,0 +1,303 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "eti-contact-plist-builder.h"
+#include "eti-sync.h"
+#include "eti-sync-journal.h"
+
+#include <glib-2.0/glib.h>
+#include <plist/plist.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Progress of the sessions which didn't complete, so that an interrupted
+ * transfer can be resumed. It's stored next to the sync state in
+ * $XDG_CACHE_HOME/eds-to-idevice/<udid>.journal, and removed once a session
+ * completes. Each line is made of tab separated fields:
+ *
+ * - "begin": start of a new session
+ * - "plan <uid> <fingerprint>": contact which is sent during this session
+ * - "remap <sent id> <device id>": ID acknowledged by the device
+ * - "main <uid>": main record acknowledged by the device
+ * - "fields <category>": fields of that category acknowledged for all the
+ *   contacts of the session
+ *
+ * This relies on the device keeping the records it acknowledged even if the
+ * session wasn't finished.
+ */
+struct _EtiSyncJournal {
+    char *filename;
+    FILE *file;
+    GHashTable *progress;
+};
+
+struct ContactProgress {
+    char *fingerprint;
+    gboolean main_sent;
+    guint fields_sent;
+};
+
+#define ALL_FIELDS_SENT ((1 << ETI_CONTACT_PLIST_BUILDER_N_OTHERS) - 1)
+
+static void contact_progress_free(struct ContactProgress *progress)
+{
+    g_free(progress->fingerprint);
+    g_free(progress);
+}
+
+static void load_line(EtiSyncJournal *journal, EtiRemapIndex *records,
+                      GHashTable *session, char **fields)
+{
+    guint n_fields;
+    struct ContactProgress *progress;
+
+    n_fields = g_strv_length(fields);
+    if ((g_strcmp0(fields[0], "begin") == 0) && (n_fields == 1)) {
+        g_hash_table_remove_all(session);
+    } else if ((g_strcmp0(fields[0], "plan") == 0) && (n_fields == 3)) {
+        progress = g_hash_table_lookup(journal->progress, fields[1]);
+        if ((progress == NULL)
+                || (g_strcmp0(progress->fingerprint, fields[2]) != 0)) {
+            progress = g_new0(struct ContactProgress, 1);
+            progress->fingerprint = g_strdup(fields[2]);
+            g_hash_table_replace(journal->progress, g_strdup(fields[1]),
+                                 progress);
+        }
+        g_hash_table_add(session, g_strdup(fields[1]));
+    } else if ((g_strcmp0(fields[0], "remap") == 0) && (n_fields == 3)) {
+        eti_remap_index_insert(records, fields[1], fields[2]);
+    } else if ((g_strcmp0(fields[0], "main") == 0) && (n_fields == 2)) {
+        progress = g_hash_table_lookup(journal->progress, fields[1]);
+        if (progress != NULL)
+            progress->main_sent = TRUE;
+    } else if ((g_strcmp0(fields[0], "fields") == 0) && (n_fields == 2)) {
+        GHashTableIter iter;
+        gpointer uid;
+        guint category;
+
+        category = strtoul(fields[1], NULL, 10);
+        if (category >= ETI_CONTACT_PLIST_BUILDER_N_OTHERS)
+            return;
+        g_hash_table_iter_init(&iter, session);
+        while (g_hash_table_iter_next(&iter, &uid, NULL)) {
+            progress = g_hash_table_lookup(journal->progress, uid);
+            if (progress != NULL)
+                progress->fields_sent |= (1 << category);
+        }
+    }
+}
+
+/* The record IDs the device acknowledged are added to @records */
+EtiSyncJournal *eti_sync_journal_load(const char *udid,
+                                      EtiRemapIndex *records)
+{
+    EtiSyncJournal *journal;
+    char *basename;
+    char *contents;
+    char **lines;
+    GHashTable *session;
+    guint i;
+
+    g_return_val_if_fail(udid != NULL, NULL);
+
+    journal = g_new0(EtiSyncJournal, 1);
+    basename = g_strdup_printf("%s.journal", udid);
+    journal->filename = g_build_filename(g_get_user_cache_dir(),
+                                         "eds-to-idevice", basename, NULL);
+    g_free(basename);
+    journal->progress = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free,
+                                              (GDestroyNotify)contact_progress_free);
+
+    if (!g_file_get_contents(journal->filename, &contents, NULL, NULL))
+        return journal;
+
+    session = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+    for (i = 0; lines[i] != NULL; i++) {
+        char **fields;
+
+        /* the last line may be incomplete if we were interrupted while
+         * writing it, it's dropped as it won't have enough fields
+         */
+        fields = g_strsplit(lines[i], "\t", -1);
+        if (fields[0] != NULL)
+            load_line(journal, records, session, fields);
+        g_strfreev(fields);
+    }
+    g_strfreev(lines);
+    g_hash_table_destroy(session);
+
+    if (g_hash_table_size(journal->progress) != 0)
+        g_print("Resuming an interrupted transfer of %u contacts\n",
+                g_hash_table_size(journal->progress));
+
+    return journal;
+}
+
+void eti_sync_journal_free(EtiSyncJournal *journal)
+{
+    if (journal->file != NULL)
+        fclose(journal->file);
+    g_hash_table_destroy(journal->progress);
+    g_free(journal->filename);
+    g_free(journal);
+}
+
+/* To be called when the session completed, or when the device dropped the
+ * records it acknowledged
+ */
+void eti_sync_journal_discard(EtiSyncJournal *journal)
+{
+    if (journal->file != NULL) {
+        fclose(journal->file);
+        journal->file = NULL;
+    }
+    g_hash_table_remove_all(journal->progress);
+    remove(journal->filename);
+}
+
+static struct ContactProgress *get_progress(EtiSyncJournal *journal,
+                                            const char *uid,
+                                            const char *fingerprint)
+{
+    struct ContactProgress *progress;
+
+    progress = g_hash_table_lookup(journal->progress, uid);
+    if ((progress == NULL)
+            || (g_strcmp0(progress->fingerprint, fingerprint) != 0))
+        return NULL;
+
+    return progress;
+}
+
+gboolean eti_sync_journal_is_main_sent(EtiSyncJournal *journal,
+                                       const char *uid,
+                                       const char *fingerprint)
+{
+    struct ContactProgress *progress;
+
+    progress = get_progress(journal, uid, fingerprint);
+
+    return ((progress != NULL) && progress->main_sent);
+}
+
+gboolean eti_sync_journal_is_sent(EtiSyncJournal *journal,
+                                  const char *uid,
+                                  const char *fingerprint)
+{
+    struct ContactProgress *progress;
+
+    progress = get_progress(journal, uid, fingerprint);
+
+    return ((progress != NULL) && progress->main_sent
+            && (progress->fields_sent == ALL_FIELDS_SENT));
+}
+
+/* Starts journaling a new session sending the contacts in @uids (record
+ * ID -> EDS UID), @fingerprints holds their fingerprints (EDS UID ->
+ * fingerprint)
+ */
+gboolean eti_sync_journal_begin(EtiSyncJournal *journal,
+                                GHashTable *uids,
+                                GHashTable *fingerprints,
+                                GError **error)
+{
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+    char *dirname;
+
+    if (journal->file == NULL) {
+        dirname = g_path_get_dirname(journal->filename);
+        g_mkdir_with_parents(dirname, 0700);
+        g_free(dirname);
+        journal->file = fopen(journal->filename, "a");
+        if (journal->file == NULL) {
+            g_set_error(error, ETI_SYNC_ERROR,
+                        ETI_SYNC_ERROR_FAILED,
+                        "failed to open %s", journal->filename);
+            return FALSE;
+        }
+    }
+
+    fprintf(journal->file, "begin\n");
+    g_hash_table_iter_init(&iter, uids);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        fprintf(journal->file, "plan\t%s\t%s\n", (char *)value,
+                (char *)g_hash_table_lookup(fingerprints, value));
+    eti_sync_journal_commit(journal);
+
+    return TRUE;
+}
+
+void eti_sync_journal_add_remaps(EtiSyncJournal *journal,
+                                 plist_t remapped_uids)
+{
+    plist_dict_iter iter;
+    char *key;
+    plist_t node;
+
+    if ((journal->file == NULL) || (remapped_uids == NULL)
+            || (plist_get_node_type(remapped_uids) != PLIST_DICT))
+        return;
+
+    iter = NULL;
+    plist_dict_new_iter(remapped_uids, &iter);
+    if (iter == NULL)
+        return;
+
+    key = NULL;
+    node = NULL;
+    plist_dict_next_item(remapped_uids, iter, &key, &node);
+    while (node) {
+        if (plist_get_node_type(node) == PLIST_STRING) {
+            char *value;
+
+            plist_get_string_val(node, &value);
+            fprintf(journal->file, "remap\t%s\t%s\n", key, value);
+            free(value);
+        }
+        free(key);
+        key = NULL;
+        plist_dict_next_item(remapped_uids, iter, &key, &node);
+    }
+    free(iter);
+}
+
+void eti_sync_journal_add_main(EtiSyncJournal *journal, const char *uid)
+{
+    if (journal->file != NULL)
+        fprintf(journal->file, "main\t%s\n", uid);
+}
+
+void eti_sync_journal_add_fields(EtiSyncJournal *journal, guint category)
+{
+    if (journal->file != NULL)
+        fprintf(journal->file, "fields\t%u\n", category);
+}
+
+/* Makes sure what was added since the last call is on disk, to be called
+ * after each batch acknowledged by the device
+ */
+void eti_sync_journal_commit(EtiSyncJournal *journal)
+{
+    if (journal->file != NULL)
+        fflush(journal->file);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef ETI_SYNC_JOURNAL_H
+#define ETI_SYNC_JOURNAL_H
+
+#include <glib-2.0/glib.h>
+#include <plist/plist.h>
+
+#include "eti-remap-index.h"
+
+typedef struct _EtiSyncJournal EtiSyncJournal;
+
+EtiSyncJournal *eti_sync_journal_load(const char *udid,
+                                      EtiRemapIndex *records);
+void eti_sync_journal_free(EtiSyncJournal *journal);
+void eti_sync_journal_discard(EtiSyncJournal *journal);
+
+gboolean eti_sync_journal_is_main_sent(EtiSyncJournal *journal,
+                                       const char *uid,
+                                       const char *fingerprint);
+gboolean eti_sync_journal_is_sent(EtiSyncJournal *journal,
+                                  const char *uid,
+                                  const char *fingerprint);
+
+gboolean eti_sync_journal_begin(EtiSyncJournal *journal,
+                                GHashTable *uids,
+                                GHashTable *fingerprints,
+                                GError **error);
+void eti_sync_journal_add_remaps(EtiSyncJournal *journal,
+                                 plist_t remapped_uids);
+void eti_sync_journal_add_main(EtiSyncJournal *journal, const char *uid);
+void eti_sync_journal_add_fields(EtiSyncJournal *journal, guint category);
+void eti_sync_journal_commit(EtiSyncJournal *journal);
+
+#endif
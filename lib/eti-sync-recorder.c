@@ -0,0 +1,659 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "eti-alloc-count.h"
+#include "eti-contact-plist-builder.h"
+#include "eti-contact-plist-parser.h"
+#include "eti-plist.h"
+#include "eti-remap-index.h"
+#include "eti-sync.h"
+#include "eti-sync-recorder.h"
+#include "eti-sync-transport.h"
+
+#include <glib-2.0/glib.h>
+#include <plist/plist.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* EtiSyncTransport forwarding to another transport while keeping a copy of
+ * everything exchanged with the device. The session is saved as a binary
+ * plist when the transport is freed:
+ *
+ *   version: 1
+ *   messages: array of
+ *     time: microseconds since the recording started
+ *     call: name of the EtiSyncTransport method
+ *     status: mobilesync_error_t it returned
+ *     entities: the plist which was sent or received, if any
+ *     is last: whether it was the last message of the batch, if relevant
+ *     sync type: for "start" only
+ *
+ * eti_sync_recorder_replay() feeds a recorded session back through the
+ * parser and the builder.
+ */
+#define ETI_SYNC_RECORDER_VERSION 1
+
+struct Recorder {
+    EtiSyncTransport parent;
+    EtiSyncTransport *transport;
+    char *filename;
+    plist_t messages;
+    gint64 start;
+};
+
+static struct Recorder *get_recorder(EtiSyncTransport *transport)
+{
+    return (struct Recorder *)transport;
+}
+
+/* @entities is copied */
+static plist_t record(struct Recorder *recorder, const char *call,
+                      mobilesync_error_t status, plist_t entities)
+{
+    plist_t message;
+
+    message = plist_new_dict();
+    plist_dict_set_item(message, "time",
+                        plist_new_uint(g_get_monotonic_time() - recorder->start));
+    plist_dict_set_item(message, "call", plist_new_string(call));
+    plist_dict_set_item(message, "status", plist_new_uint(status));
+    if (entities != NULL)
+        plist_dict_set_item(message, "entities", plist_copy(entities));
+    plist_array_append_item(recorder->messages, message);
+
+    return message;
+}
+
+static mobilesync_error_t recorder_start(EtiSyncTransport *transport,
+                                         const char *data_class,
+                                         mobilesync_anchors_t anchors,
+                                         uint64_t computer_data_class_version,
+                                         mobilesync_sync_type_t *sync_type,
+                                         uint64_t *device_data_class_version,
+                                         char **error_description)
+{
+    struct Recorder *recorder = get_recorder(transport);
+    mobilesync_error_t status;
+    plist_t message;
+
+    status = recorder->transport->start(recorder->transport, data_class,
+                                        anchors, computer_data_class_version,
+                                        sync_type, device_data_class_version,
+                                        error_description);
+    message = record(recorder, "start", status, NULL);
+    if (MOBILESYNC_E_SUCCESS == status)
+        plist_dict_set_item(message, "sync type", plist_new_uint(*sync_type));
+
+    return status;
+}
+
+static mobilesync_error_t recorder_get_all_records(EtiSyncTransport *transport)
+{
+    struct Recorder *recorder = get_recorder(transport);
+    mobilesync_error_t status;
+
+    status = recorder->transport->get_all_records_from_device(recorder->transport);
+    record(recorder, "get_all_records_from_device", status, NULL);
+
+    return status;
+}
+
+static mobilesync_error_t recorder_get_changes(EtiSyncTransport *transport)
+{
+    struct Recorder *recorder = get_recorder(transport);
+    mobilesync_error_t status;
+
+    status = recorder->transport->get_changes_from_device(recorder->transport);
+    record(recorder, "get_changes_from_device", status, NULL);
+
+    return status;
+}
+
+static mobilesync_error_t recorder_receive_changes(EtiSyncTransport *transport,
+                                                   plist_t *entities,
+                                                   uint8_t *is_last_record)
+{
+    struct Recorder *recorder = get_recorder(transport);
+    mobilesync_error_t status;
+    plist_t message;
+
+    status = recorder->transport->receive_changes(recorder->transport,
+                                                  entities, is_last_record);
+    if (MOBILESYNC_E_SUCCESS != status) {
+        record(recorder, "receive_changes", status, NULL);
+        return status;
+    }
+    message = record(recorder, "receive_changes", status, *entities);
+    plist_dict_set_item(message, "is last", plist_new_bool(*is_last_record));
+
+    return status;
+}
+
+static mobilesync_error_t recorder_acknowledge(EtiSyncTransport *transport)
+{
+    struct Recorder *recorder = get_recorder(transport);
+    mobilesync_error_t status;
+
+    status = recorder->transport->acknowledge_changes_from_device(recorder->transport);
+    record(recorder, "acknowledge_changes_from_device", status, NULL);
+
+    return status;
+}
+
+static mobilesync_error_t recorder_ready_to_send(EtiSyncTransport *transport)
+{
+    struct Recorder *recorder = get_recorder(transport);
+    mobilesync_error_t status;
+
+    status = recorder->transport->ready_to_send_changes_from_computer(recorder->transport);
+    record(recorder, "ready_to_send_changes_from_computer", status, NULL);
+
+    return status;
+}
+
+static mobilesync_error_t recorder_send_changes(EtiSyncTransport *transport,
+                                                plist_t entities,
+                                                uint8_t is_last_record)
+{
+    struct Recorder *recorder = get_recorder(transport);
+    mobilesync_error_t status;
+    plist_t message;
+
+    status = recorder->transport->send_changes(recorder->transport,
+                                               entities, is_last_record);
+    message = record(recorder, "send_changes", status, entities);
+    plist_dict_set_item(message, "is last", plist_new_bool(is_last_record));
+
+    return status;
+}
+
+static mobilesync_error_t recorder_remap_identifiers(EtiSyncTransport *transport,
+                                                     plist_t *mapping)
+{
+    struct Recorder *recorder = get_recorder(transport);
+    mobilesync_error_t status;
+
+    status = recorder->transport->remap_identifiers(recorder->transport,
+                                                    mapping);
+    if (MOBILESYNC_E_SUCCESS == status)
+        record(recorder, "remap_identifiers", status, *mapping);
+    else
+        record(recorder, "remap_identifiers", status, NULL);
+
+    return status;
+}
+
+static mobilesync_error_t recorder_clear_all(EtiSyncTransport *transport)
+{
+    struct Recorder *recorder = get_recorder(transport);
+    mobilesync_error_t status;
+
+    status = recorder->transport->clear_all_records_on_device(recorder->transport);
+    record(recorder, "clear_all_records_on_device", status, NULL);
+
+    return status;
+}
+
+static mobilesync_error_t recorder_finish(EtiSyncTransport *transport)
+{
+    struct Recorder *recorder = get_recorder(transport);
+    mobilesync_error_t status;
+
+    status = recorder->transport->finish(recorder->transport);
+    record(recorder, "finish", status, NULL);
+
+    return status;
+}
+
+static void save_recording(struct Recorder *recorder)
+{
+    plist_t session;
+    char *bin = NULL;
+    uint32_t length = 0;
+    GError *error = NULL;
+
+    session = plist_new_dict();
+    plist_dict_set_item(session, "version",
+                        plist_new_uint(ETI_SYNC_RECORDER_VERSION));
+    plist_dict_set_item(session, "messages", recorder->messages);
+    recorder->messages = NULL;
+
+    plist_to_bin(session, &bin, &length);
+    plist_free(session);
+    if (bin == NULL) {
+        g_warning("couldn't serialize the session recorded to %s",
+                  recorder->filename);
+        return;
+    }
+    if (!g_file_set_contents(recorder->filename, bin, length, &error)) {
+        g_warning("couldn't save recorded session: %s", error->message);
+        g_error_free(error);
+    }
+    free(bin);
+}
+
+static void recorder_free(EtiSyncTransport *transport)
+{
+    struct Recorder *recorder = get_recorder(transport);
+
+    save_recording(recorder);
+    recorder->transport->free(recorder->transport);
+    g_free(recorder->filename);
+    g_free(recorder);
+}
+
+/* Takes ownership of @transport. The session is written to @filename when
+ * the returned transport is freed, so that aborted sessions are kept too.
+ */
+EtiSyncTransport *eti_sync_recorder_new(EtiSyncTransport *transport,
+                                        const char *filename)
+{
+    struct Recorder *recorder;
+
+    recorder = g_new0(struct Recorder, 1);
+    recorder->transport = transport;
+    recorder->filename = g_strdup(filename);
+    recorder->messages = plist_new_array();
+    recorder->start = g_get_monotonic_time();
+
+    recorder->parent.start = recorder_start;
+    recorder->parent.get_all_records_from_device = recorder_get_all_records;
+    recorder->parent.get_changes_from_device = recorder_get_changes;
+    recorder->parent.receive_changes = recorder_receive_changes;
+    recorder->parent.acknowledge_changes_from_device = recorder_acknowledge;
+    recorder->parent.ready_to_send_changes_from_computer = recorder_ready_to_send;
+    recorder->parent.send_changes = recorder_send_changes;
+    recorder->parent.remap_identifiers = recorder_remap_identifiers;
+    recorder->parent.clear_all_records_on_device = recorder_clear_all;
+    recorder->parent.finish = recorder_finish;
+    recorder->parent.free = recorder_free;
+
+    return (EtiSyncTransport *)recorder;
+}
+
+static plist_t load_recording(const char *filename, GError **error)
+{
+    char *contents;
+    gsize length;
+    plist_t session;
+    plist_t messages;
+
+    if (!g_file_get_contents(filename, &contents, &length, error))
+        return NULL;
+
+    session = NULL;
+    plist_from_bin(contents, length, &session);
+    g_free(contents);
+    if ((session == NULL) || (plist_get_node_type(session) != PLIST_DICT))
+        goto invalid;
+
+    messages = plist_dict_get_item(session, "messages");
+    if ((messages == NULL) || (plist_get_node_type(messages) != PLIST_ARRAY))
+        goto invalid;
+
+    return session;
+
+invalid:
+    g_set_error(error, ETI_SYNC_ERROR, ETI_SYNC_ERROR_READING,
+                "%s is not a recorded synchronization session", filename);
+    if (session != NULL)
+        plist_free(session);
+    return NULL;
+}
+
+static gboolean is_call(plist_t message, const char *call)
+{
+    char *name;
+    gboolean matches;
+
+    name = eti_plist_dict_get_string(message, "call");
+    matches = (g_strcmp0(name, call) == 0);
+    free(name);
+
+    return matches;
+}
+
+static plist_t get_entities(plist_t message)
+{
+    plist_t entities;
+
+    entities = plist_dict_get_item(message, "entities");
+    if ((entities == NULL) || (plist_get_node_type(entities) != PLIST_DICT))
+        return NULL;
+
+    return entities;
+}
+
+static gboolean is_contact_record(plist_t node)
+{
+    char *entity_name;
+    gboolean is_contact;
+
+    entity_name = eti_plist_dict_get_string(node,
+                                            "com.apple.syncservices.RecordEntityName");
+    is_contact = (g_strcmp0(entity_name, "com.apple.contacts.Contact") == 0);
+    free(entity_name);
+
+    return is_contact;
+}
+
+/* What we sent uses our own IDs for new records, the fields sent after
+ * them refer to the IDs the device gave back. Renames the former so that
+ * the parser can attach the fields to their contact. Deletions are
+ * skipped, they aren't records. The IDs of the main contact records are
+ * added to @contact_ids.
+ */
+static plist_t remap_sent_records(plist_t entities, EtiRemapIndex *remapped,
+                                  GHashTable *contact_ids)
+{
+    plist_dict_iter iter = NULL;
+    char *key = NULL;
+    plist_t node = NULL;
+    plist_t records;
+
+    records = plist_new_dict();
+    plist_dict_new_iter(entities, &iter);
+    if (iter == NULL)
+        return records;
+
+    plist_dict_next_item(entities, iter, &key, &node);
+    while (node != NULL) {
+        if (plist_get_node_type(node) == PLIST_DICT) {
+            const char *id;
+
+            id = eti_remap_index_lookup(remapped, key);
+            if (id == NULL)
+                id = key;
+            plist_dict_set_item(records, id, plist_copy(node));
+            if (is_contact_record(node))
+                g_hash_table_add(contact_ids, g_strdup(id));
+        }
+        free(key);
+        key = NULL;
+        plist_dict_next_item(entities, iter, &key, &node);
+    }
+    free(iter);
+
+    return records;
+}
+
+static gboolean replay_parse(EtiContactPlistParser *parser, plist_t entities,
+                             EtiStats *stats, const char *phase,
+                             GError **error)
+{
+    gboolean parse_ok;
+    gint64 start;
+
+    start = g_get_monotonic_time();
+    parse_ok = eti_contact_plist_parser_parse(parser, entities, error);
+    eti_stats_add(stats, phase, g_get_monotonic_time() - start,
+                  plist_dict_get_size(entities), 0);
+
+    return parse_ok;
+}
+
+static void replay_build(GHashTable *contacts, EtiRemapIndex *remapped,
+                         EtiStats *stats)
+{
+    plist_t main_records;
+    GList *others;
+    GList *it;
+    guint n_records;
+    gint64 start;
+
+    if (g_hash_table_size(contacts) == 0)
+        return;
+
+    start = g_get_monotonic_time();
+    main_records = eti_contact_plist_builder_build_main(contacts);
+    eti_stats_add(stats, "build main records", g_get_monotonic_time() - start,
+                  plist_dict_get_size(main_records), 0);
+    plist_free(main_records);
+
+    start = g_get_monotonic_time();
+    others = eti_contact_plist_builder_build_others(contacts, remapped);
+    n_records = 0;
+    for (it = others; it != NULL; it = it->next)
+        n_records += plist_dict_get_size(it->data);
+    eti_stats_add(stats, "build fields", g_get_monotonic_time() - start,
+                  n_records, 0);
+    g_list_free_full(others, (GDestroyNotify)plist_free);
+}
+
+static EtiRemapIndex *load_remaps(plist_t messages)
+{
+    EtiRemapIndex *remapped;
+    guint i;
+
+    remapped = eti_remap_index_new();
+    for (i = 0; i < plist_array_get_size(messages); i++) {
+        plist_t message = plist_array_get_item(messages, i);
+        plist_t mapping = get_entities(message);
+
+        if ((mapping != NULL) && is_call(message, "remap_identifiers"))
+            eti_remap_index_add_plist(remapped, mapping);
+    }
+
+    return remapped;
+}
+
+/* Runs the records of a session saved by eti_sync_recorder_new() through
+ * eti_contact_plist_parser_parse() and the builder, without waiting for
+ * anything, and adds the time spent in each to @stats. What was received
+ * from the device and what was sent to it are parsed separately, then
+ * both sets of contacts are built again.
+ */
+gboolean eti_sync_recorder_replay(const char *filename, EtiStats *stats,
+                                  GError **error)
+{
+    plist_t session;
+    plist_t messages;
+    EtiRemapIndex *remapped;
+    EtiContactPlistParser *device_parser;
+    EtiContactPlistParser *sent_parser;
+    GHashTable *sent_contact_ids;
+    gboolean replay_ok;
+    guint i;
+
+    session = load_recording(filename, error);
+    if (session == NULL)
+        return FALSE;
+    messages = plist_dict_get_item(session, "messages");
+
+    remapped = load_remaps(messages);
+    device_parser = eti_contact_plist_parser_new();
+    sent_parser = eti_contact_plist_parser_new();
+    /* photos sent last come with a second copy of the main records */
+    sent_contact_ids = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             g_free, NULL);
+    replay_ok = TRUE;
+    for (i = 0; (i < plist_array_get_size(messages)) && replay_ok; i++) {
+        plist_t message = plist_array_get_item(messages, i);
+        plist_t entities = get_entities(message);
+
+        if (entities == NULL)
+            continue;
+        if (is_call(message, "receive_changes")) {
+            replay_ok = replay_parse(device_parser, entities, stats,
+                                     "parse device records", error);
+        } else if (is_call(message, "send_changes")) {
+            plist_t records = remap_sent_records(entities, remapped,
+                                                 sent_contact_ids);
+
+            replay_ok = replay_parse(sent_parser, records, stats,
+                                     "parse sent records", error);
+            plist_free(records);
+        }
+    }
+
+    eti_stats_add(stats, "orphaned device records", 0,
+                  eti_contact_plist_parser_finish(device_parser), 0);
+    eti_stats_add(stats, "orphaned sent records", 0,
+                  eti_contact_plist_parser_finish(sent_parser), 0);
+    if (replay_ok
+            && (g_hash_table_size(eti_contact_plist_parser_get_contacts(sent_parser))
+                != g_hash_table_size(sent_contact_ids))) {
+        g_set_error(error, ETI_SYNC_ERROR, ETI_SYNC_ERROR_FAILED,
+                    "%u contacts were sent but %u could be parsed back",
+                    g_hash_table_size(sent_contact_ids),
+                    g_hash_table_size(eti_contact_plist_parser_get_contacts(sent_parser)));
+        replay_ok = FALSE;
+    }
+    if (replay_ok) {
+        replay_build(eti_contact_plist_parser_get_contacts(device_parser),
+                     remapped, stats);
+        replay_build(eti_contact_plist_parser_get_contacts(sent_parser),
+                     remapped, stats);
+    }
+
+    eti_contact_plist_parser_free(device_parser, TRUE);
+    eti_contact_plist_parser_free(sent_parser, TRUE);
+    g_hash_table_destroy(sent_contact_ids);
+    eti_remap_index_free(remapped);
+    plist_free(session);
+
+    return replay_ok;
+}
+
+/* Parses the records received from the device in a session saved by
+ * eti_sync_recorder_new() @iterations times with a fresh parser, and adds
+ * the time it took to @stats. Only eti_contact_plist_parser_parse() is
+ * timed, so the records/s of the "parse benchmark" phase is the per-record
+ * parsing cost.
+ */
+gboolean eti_sync_recorder_bench_parser(const char *filename,
+                                        guint iterations, EtiStats *stats,
+                                        GError **error)
+{
+    plist_t session;
+    plist_t messages;
+    gboolean parse_ok;
+    guint i;
+
+    session = load_recording(filename, error);
+    if (session == NULL)
+        return FALSE;
+    messages = plist_dict_get_item(session, "messages");
+
+    parse_ok = TRUE;
+    while ((iterations-- > 0) && parse_ok) {
+        EtiContactPlistParser *parser;
+
+        parser = eti_contact_plist_parser_new();
+        for (i = 0; (i < plist_array_get_size(messages)) && parse_ok; i++) {
+            plist_t message = plist_array_get_item(messages, i);
+            plist_t entities = get_entities(message);
+
+            if ((entities != NULL) && is_call(message, "receive_changes"))
+                parse_ok = replay_parse(parser, entities, stats,
+                                        "parse benchmark", error);
+        }
+        eti_contact_plist_parser_finish(parser);
+        eti_contact_plist_parser_free(parser, TRUE);
+    }
+    plist_free(session);
+
+    return parse_ok;
+}
+
+/* Builds the main and field records of @contacts @iterations times and adds
+ * the time it took to the "build benchmark" phase of @stats. When configured
+ * with --enable-alloc-count, the number of allocations made by each build
+ * is added as the records of the "build allocations" phase. @remapped can
+ * be NULL.
+ */
+void eti_sync_recorder_bench_builder(GHashTable *contacts,
+                                     EtiRemapIndex *remapped,
+                                     guint iterations, EtiStats *stats)
+{
+    while (iterations-- > 0) {
+        plist_t main_records;
+        GList *others;
+        GList *it;
+        guint n_records;
+        gint64 start;
+        gint64 usecs;
+        gint64 allocations;
+
+        eti_alloc_count_start();
+        start = g_get_monotonic_time();
+        main_records = eti_contact_plist_builder_build_main(contacts);
+        others = eti_contact_plist_builder_build_others(contacts, remapped);
+        usecs = g_get_monotonic_time() - start;
+        allocations = eti_alloc_count_stop();
+
+        n_records = plist_dict_get_size(main_records);
+        for (it = others; it != NULL; it = it->next)
+            n_records += plist_dict_get_size(it->data);
+        eti_stats_add(stats, "build benchmark", usecs, n_records, 0);
+        if (allocations >= 0)
+            eti_stats_add(stats, "build allocations", 0, (guint)allocations,
+                          0);
+        plist_free(main_records);
+        g_list_free_full(others, (GDestroyNotify)plist_free);
+    }
+}
+
+/* Same as eti_sync_recorder_bench_builder() with the contacts sent to the
+ * device in a session saved by eti_sync_recorder_new()
+ */
+gboolean eti_sync_recorder_bench_recorded_builder(const char *filename,
+                                                  guint iterations,
+                                                  EtiStats *stats,
+                                                  GError **error)
+{
+    plist_t session;
+    plist_t messages;
+    EtiRemapIndex *remapped;
+    EtiContactPlistParser *parser;
+    GHashTable *contact_ids;
+    gboolean parse_ok;
+    guint i;
+
+    session = load_recording(filename, error);
+    if (session == NULL)
+        return FALSE;
+    messages = plist_dict_get_item(session, "messages");
+
+    remapped = load_remaps(messages);
+    parser = eti_contact_plist_parser_new();
+    contact_ids = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                        g_free, NULL);
+    parse_ok = TRUE;
+    for (i = 0; (i < plist_array_get_size(messages)) && parse_ok; i++) {
+        plist_t message = plist_array_get_item(messages, i);
+        plist_t entities = get_entities(message);
+        plist_t records;
+
+        if ((entities == NULL) || !is_call(message, "send_changes"))
+            continue;
+        records = remap_sent_records(entities, remapped, contact_ids);
+        parse_ok = eti_contact_plist_parser_parse(parser, records, error);
+        plist_free(records);
+    }
+    eti_contact_plist_parser_finish(parser);
+    if (parse_ok)
+        eti_sync_recorder_bench_builder(eti_contact_plist_parser_get_contacts(parser),
+                                        remapped, iterations, stats);
+
+    eti_contact_plist_parser_free(parser, TRUE);
+    g_hash_table_destroy(contact_ids);
+    eti_remap_index_free(remapped);
+    plist_free(session);
+
+    return parse_ok;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef ETI_SYNC_RECORDER_H
+#define ETI_SYNC_RECORDER_H
+
+#include <glib-2.0/glib.h>
+
+#include "eti-remap-index.h"
+#include "eti-stats.h"
+#include "eti-sync-transport.h"
+
+EtiSyncTransport *eti_sync_recorder_new(EtiSyncTransport *transport,
+                                        const char *filename);
+gboolean eti_sync_recorder_replay(const char *filename, EtiStats *stats,
+                                  GError **error);
+gboolean eti_sync_recorder_bench_parser(const char *filename,
+                                        guint iterations, EtiStats *stats,
+                                        GError **error);
+void eti_sync_recorder_bench_builder(GHashTable *contacts,
+                                     EtiRemapIndex *remapped,
+                                     guint iterations, EtiStats *stats);
+gboolean eti_sync_recorder_bench_recorded_builder(const char *filename,
+                                                  guint iterations,
+                                                  EtiStats *stats,
+                                                  GError **error);
+
+#endif
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "eti-contact-plist-builder.h"
+#include "eti-plist.h"
+#include "eti-sync.h"
+#include "eti-sync-state.h"
+
+#include <glib-2.0/glib.h>
+#include <plist/plist.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* What we remember about a device between 2 runs. This is stored as an XML
+ * plist in $XDG_CACHE_HOME/eds-to-idevice/<udid>.plist, losing it is
+ * harmless, it only means the next synchronization will be a slow one.
+ *
+ * - the anchors sent to mobilesync_start() during the last successful sync
+ * - "fingerprints": EDS UID -> fingerprint of the contact as last sent
+ * - "records": ID we sent -> ID the device remapped it to
+ * - "batch records": number of contacts per message the device handled
+ *   within the target latency, 0 if unknown
+ */
+struct _EtiSyncState {
+    char *filename;
+    char *device_anchor;
+    char *host_anchor;
+    GHashTable *fingerprints;
+    EtiRemapIndex *records;
+    guint batch_records;
+};
+
+static char *get_state_filename(const char *udid)
+{
+    char *basename;
+    char *filename;
+
+    basename = g_strdup_printf("%s.plist", udid);
+    filename = g_build_filename(g_get_user_cache_dir(), "eds-to-idevice",
+                                basename, NULL);
+    g_free(basename);
+
+    return filename;
+}
+
+static void load_fingerprints(EtiSyncState *state, plist_t fingerprints)
+{
+    plist_dict_iter iter;
+    char *key;
+    plist_t node;
+
+    if (plist_get_node_type(fingerprints) != PLIST_DICT)
+        return;
+
+    iter = NULL;
+    plist_dict_new_iter(fingerprints, &iter);
+    if (iter == NULL)
+        return;
+
+    key = NULL;
+    node = NULL;
+    plist_dict_next_item(fingerprints, iter, &key, &node);
+    while (node) {
+        if (plist_get_node_type(node) == PLIST_STRING) {
+            char *value;
+
+            plist_get_string_val(node, &value);
+            g_hash_table_insert(state->fingerprints,
+                                g_strdup(key), g_strdup(value));
+            free(value);
+        }
+        free(key);
+        key = NULL;
+        plist_dict_next_item(fingerprints, iter, &key, &node);
+    }
+    free(iter);
+}
+
+static void load_state(EtiSyncState *state)
+{
+    char *contents;
+    gsize length;
+    plist_t root;
+    plist_t node;
+
+    if (!g_file_get_contents(state->filename, &contents, &length, NULL))
+        return;
+
+    root = NULL;
+    plist_from_xml(contents, length, &root);
+    g_free(contents);
+    if (root == NULL)
+        return;
+    if (plist_get_node_type(root) != PLIST_DICT) {
+        plist_free(root);
+        return;
+    }
+
+    state->device_anchor = eti_plist_dict_get_string(root, "device anchor");
+    state->host_anchor = eti_plist_dict_get_string(root, "host anchor");
+
+    node = plist_dict_get_item(root, "fingerprints");
+    if (node != NULL)
+        load_fingerprints(state, node);
+
+    node = plist_dict_get_item(root, "records");
+    if (node != NULL)
+        eti_remap_index_add_plist(state->records, node);
+
+    node = plist_dict_get_item(root, "batch records");
+    if ((node != NULL) && (plist_get_node_type(node) == PLIST_UINT)) {
+        uint64_t batch_records;
+
+        plist_get_uint_val(node, &batch_records);
+        state->batch_records = MIN(batch_records, G_MAXUINT);
+    }
+
+    plist_free(root);
+}
+
+EtiSyncState *eti_sync_state_load(const char *udid)
+{
+    EtiSyncState *state;
+
+    g_return_val_if_fail(udid != NULL, NULL);
+
+    state = g_new0(EtiSyncState, 1);
+    state->filename = get_state_filename(udid);
+    state->fingerprints = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                g_free, g_free);
+    state->records = eti_remap_index_new();
+    load_state(state);
+
+    return state;
+}
+
+gboolean eti_sync_state_save(EtiSyncState *state, GError **error)
+{
+    plist_t root;
+    plist_t fingerprints;
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+    char *xml;
+    uint32_t len;
+    char *dirname;
+    gboolean saved;
+
+    root = plist_new_dict();
+    eti_plist_dict_set_string(root, "device anchor", state->device_anchor);
+    eti_plist_dict_set_string(root, "host anchor", state->host_anchor);
+
+    fingerprints = plist_new_dict();
+    g_hash_table_iter_init(&iter, state->fingerprints);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        eti_plist_dict_set_string(fingerprints, key, value);
+    plist_dict_set_item(root, "fingerprints", fingerprints);
+    plist_dict_set_item(root, "records",
+                        eti_remap_index_to_plist(state->records));
+    if (state->batch_records != 0)
+        plist_dict_set_item(root, "batch records",
+                            plist_new_uint(state->batch_records));
+
+    xml = NULL;
+    len = 0;
+    plist_to_xml(root, &xml, &len);
+    plist_free(root);
+    if (xml == NULL) {
+        g_set_error(error, ETI_SYNC_ERROR,
+                    ETI_SYNC_ERROR_FAILED,
+                    "failed to serialize synchronization state");
+        return FALSE;
+    }
+
+    dirname = g_path_get_dirname(state->filename);
+    g_mkdir_with_parents(dirname, 0700);
+    g_free(dirname);
+
+    saved = g_file_set_contents(state->filename, xml, len, error);
+    free(xml);
+
+    return saved;
+}
+
+void eti_sync_state_free(EtiSyncState *state)
+{
+    g_free(state->filename);
+    free(state->device_anchor);
+    free(state->host_anchor);
+    g_hash_table_destroy(state->fingerprints);
+    eti_remap_index_free(state->records);
+    g_free(state);
+}
+
+const char *eti_sync_state_get_device_anchor(EtiSyncState *state)
+{
+    return state->device_anchor;
+}
+
+const char *eti_sync_state_get_host_anchor(EtiSyncState *state)
+{
+    return state->host_anchor;
+}
+
+void eti_sync_state_set_anchors(EtiSyncState *state,
+                                const char *device_anchor,
+                                const char *host_anchor)
+{
+    /* anchors read from disk come from libplist and must be released
+     * with free(), use the same allocator for the new ones
+     */
+    free(state->device_anchor);
+    state->device_anchor = (device_anchor != NULL)?strdup(device_anchor):NULL;
+    free(state->host_anchor);
+    state->host_anchor = (host_anchor != NULL)?strdup(host_anchor):NULL;
+}
+
+const char *eti_sync_state_get_fingerprint(EtiSyncState *state,
+                                           const char *uid)
+{
+    return g_hash_table_lookup(state->fingerprints, uid);
+}
+
+void eti_sync_state_set_fingerprint(EtiSyncState *state, const char *uid,
+                                    const char *fingerprint)
+{
+    if (fingerprint == NULL) {
+        g_hash_table_remove(state->fingerprints, uid);
+        return;
+    }
+    g_hash_table_replace(state->fingerprints,
+                         g_strdup(uid), g_strdup(fingerprint));
+}
+
+EtiRemapIndex *eti_sync_state_get_records(EtiSyncState *state)
+{
+    return state->records;
+}
+
+const char *eti_sync_state_get_device_id(EtiSyncState *state,
+                                         const char *uid)
+{
+    return eti_remap_index_lookup(state->records, uid);
+}
+
+void eti_sync_state_add_records(EtiSyncState *state, plist_t remapped_uids)
+{
+    eti_remap_index_add_plist(state->records, remapped_uids);
+}
+
+guint eti_sync_state_get_batch_records(EtiSyncState *state)
+{
+    return state->batch_records;
+}
+
+void eti_sync_state_set_batch_records(EtiSyncState *state, guint records)
+{
+    state->batch_records = records;
+}
+
+/* Forgets a contact which was deleted from the device, its field records
+ * must be forgotten separately
+ */
+void eti_sync_state_forget_contact(EtiSyncState *state, const char *uid)
+{
+    g_hash_table_remove(state->fingerprints, uid);
+    eti_remap_index_remove(state->records, uid);
+}
+
+void eti_sync_state_forget_record(EtiSyncState *state, const char *uid)
+{
+    eti_remap_index_remove(state->records, uid);
+}
+
+struct PruneData {
+    GHashTable *device_ids;
+    GPtrArray *stale;
+};
+
+static void find_stale_record(gpointer key, gpointer value,
+                              gpointer user_data)
+{
+    struct PruneData *data = (struct PruneData *)user_data;
+    gchar *owner;
+
+    owner = eti_contact_plist_builder_get_field_owner(key);
+    if (owner == NULL) {
+        if (!g_hash_table_contains(data->device_ids, value))
+            g_ptr_array_add(data->stale, g_strdup(key));
+        return;
+    }
+    if (!g_hash_table_contains(data->device_ids, owner))
+        g_ptr_array_add(data->stale, g_strdup(key));
+    g_free(owner);
+}
+
+/* Forgets the contacts which are not on the device anymore (and their
+ * fields) so that they get sent again as new records. @device_ids must be
+ * the IDs of all the contacts on the device, as received during a slow sync.
+ */
+void eti_sync_state_prune_records(EtiSyncState *state,
+                                  GHashTable *device_ids)
+{
+    struct PruneData data;
+    guint i;
+
+    data.device_ids = device_ids;
+    data.stale = g_ptr_array_new_with_free_func(g_free);
+    eti_remap_index_foreach(state->records, find_stale_record, &data);
+    for (i = 0; i < data.stale->len; i++)
+        eti_sync_state_forget_contact(state,
+                                      g_ptr_array_index(data.stale, i));
+    g_ptr_array_free(data.stale, TRUE);
+}
+
+/* Forgets what was sent to the device, the next synchronization will
+ * consider every contact as modified
+ */
+void eti_sync_state_forget_contacts(EtiSyncState *state)
+{
+    g_hash_table_remove_all(state->fingerprints);
+}
+
+/* Forgets the IDs the device gave to our records, to be used when the
+ * records were removed from the device
+ */
+void eti_sync_state_forget_records(EtiSyncState *state)
+{
+    eti_remap_index_free(state->records);
+    state->records = eti_remap_index_new();
+    eti_sync_state_forget_contacts(state);
+}
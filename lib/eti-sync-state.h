@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef ETI_SYNC_STATE_H
+#define ETI_SYNC_STATE_H
+
+#include <glib-2.0/glib.h>
+#include <plist/plist.h>
+
+#include "eti-remap-index.h"
+
+typedef struct _EtiSyncState EtiSyncState;
+
+EtiSyncState *eti_sync_state_load(const char *udid);
+gboolean eti_sync_state_save(EtiSyncState *state, GError **error);
+void eti_sync_state_free(EtiSyncState *state);
+
+const char *eti_sync_state_get_device_anchor(EtiSyncState *state);
+const char *eti_sync_state_get_host_anchor(EtiSyncState *state);
+void eti_sync_state_set_anchors(EtiSyncState *state,
+                                const char *device_anchor,
+                                const char *host_anchor);
+
+const char *eti_sync_state_get_fingerprint(EtiSyncState *state,
+                                           const char *uid);
+void eti_sync_state_set_fingerprint(EtiSyncState *state, const char *uid,
+                                    const char *fingerprint);
+
+EtiRemapIndex *eti_sync_state_get_records(EtiSyncState *state);
+const char *eti_sync_state_get_device_id(EtiSyncState *state,
+                                         const char *uid);
+void eti_sync_state_add_records(EtiSyncState *state, plist_t remapped_uids);
+
+guint eti_sync_state_get_batch_records(EtiSyncState *state);
+void eti_sync_state_set_batch_records(EtiSyncState *state, guint records);
+
+void eti_sync_state_forget_contact(EtiSyncState *state, const char *uid);
+void eti_sync_state_forget_record(EtiSyncState *state, const char *uid);
+void eti_sync_state_prune_records(EtiSyncState *state,
+                                  GHashTable *device_ids);
+void eti_sync_state_forget_contacts(EtiSyncState *state);
+void eti_sync_state_forget_records(EtiSyncState *state);
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "eti-sync.h"
+#include "eti-sync-transport.h"
+
+#include <glib-2.0/glib.h>
+#include <libimobiledevice/mobilesync.h>
+
+/* EtiSyncTransport talking to a real device through libimobiledevice */
+struct MobilesyncTransport {
+    EtiSyncTransport parent;
+    mobilesync_client_t client;
+};
+
+static mobilesync_client_t get_client(EtiSyncTransport *transport)
+{
+    return ((struct MobilesyncTransport *)transport)->client;
+}
+
+static mobilesync_error_t mobilesync_transport_start(EtiSyncTransport *transport,
+                                                     const char *data_class,
+                                                     mobilesync_anchors_t anchors,
+                                                     uint64_t computer_data_class_version,
+                                                     mobilesync_sync_type_t *sync_type,
+                                                     uint64_t *device_data_class_version,
+                                                     char **error_description)
+{
+    return mobilesync_start(get_client(transport), data_class, anchors,
+                            computer_data_class_version, sync_type,
+                            device_data_class_version, error_description);
+}
+
+static mobilesync_error_t mobilesync_transport_get_all_records(EtiSyncTransport *transport)
+{
+    return mobilesync_get_all_records_from_device(get_client(transport));
+}
+
+static mobilesync_error_t mobilesync_transport_get_changes(EtiSyncTransport *transport)
+{
+    return mobilesync_get_changes_from_device(get_client(transport));
+}
+
+static mobilesync_error_t mobilesync_transport_receive_changes(EtiSyncTransport *transport,
+                                                               plist_t *entities,
+                                                               uint8_t *is_last_record)
+{
+    return mobilesync_receive_changes(get_client(transport), entities,
+                                      is_last_record, NULL);
+}
+
+static mobilesync_error_t mobilesync_transport_acknowledge(EtiSyncTransport *transport)
+{
+    return mobilesync_acknowledge_changes_from_device(get_client(transport));
+}
+
+static mobilesync_error_t mobilesync_transport_ready_to_send(EtiSyncTransport *transport)
+{
+    return mobilesync_ready_to_send_changes_from_computer(get_client(transport));
+}
+
+static mobilesync_error_t mobilesync_transport_send_changes(EtiSyncTransport *transport,
+                                                            plist_t entities,
+                                                            uint8_t is_last_record)
+{
+    return mobilesync_send_changes(get_client(transport), entities,
+                                   is_last_record, NULL);
+}
+
+static mobilesync_error_t mobilesync_transport_remap_identifiers(EtiSyncTransport *transport,
+                                                                 plist_t *mapping)
+{
+    return mobilesync_remap_identifiers(get_client(transport), mapping);
+}
+
+static mobilesync_error_t mobilesync_transport_clear_all(EtiSyncTransport *transport)
+{
+    return mobilesync_clear_all_records_on_device(get_client(transport));
+}
+
+static mobilesync_error_t mobilesync_transport_finish(EtiSyncTransport *transport)
+{
+    return mobilesync_finish(get_client(transport));
+}
+
+static void mobilesync_transport_free(EtiSyncTransport *transport)
+{
+    mobilesync_client_free(get_client(transport));
+    g_free(transport);
+}
+
+EtiSyncTransport *eti_sync_transport_new_mobilesync(idevice_t device,
+                                                    lockdownd_service_descriptor_t service,
+                                                    GError **error)
+{
+    struct MobilesyncTransport *transport;
+    mobilesync_error_t m_status;
+
+    transport = g_new0(struct MobilesyncTransport, 1);
+    m_status = mobilesync_client_new(device, service, &transport->client);
+    if (MOBILESYNC_E_SUCCESS != m_status) {
+        g_set_error(error, ETI_SYNC_ERROR,
+                    ETI_SYNC_ERROR_IDEVICE_COMMUNICATION,
+                    "failed to create mobilesync client\n");
+        g_free(transport);
+        return NULL;
+    }
+
+    transport->parent.start = mobilesync_transport_start;
+    transport->parent.get_all_records_from_device = mobilesync_transport_get_all_records;
+    transport->parent.get_changes_from_device = mobilesync_transport_get_changes;
+    transport->parent.receive_changes = mobilesync_transport_receive_changes;
+    transport->parent.acknowledge_changes_from_device = mobilesync_transport_acknowledge;
+    transport->parent.ready_to_send_changes_from_computer = mobilesync_transport_ready_to_send;
+    transport->parent.send_changes = mobilesync_transport_send_changes;
+    transport->parent.remap_identifiers = mobilesync_transport_remap_identifiers;
+    transport->parent.clear_all_records_on_device = mobilesync_transport_clear_all;
+    transport->parent.finish = mobilesync_transport_finish;
+    transport->parent.free = mobilesync_transport_free;
+
+    return (EtiSyncTransport *)transport;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef ETI_SYNC_TRANSPORT_H
+#define ETI_SYNC_TRANSPORT_H
+
+#include <glib-2.0/glib.h>
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/mobilesync.h>
+#include <plist/plist.h>
+
+/* Peer of a synchronization session. This mirrors the parts of the
+ * mobilesync API EtiSync uses so that it can talk either to a real device
+ * or to a fake one (see eti-mock-device.h).
+ */
+typedef struct _EtiSyncTransport EtiSyncTransport;
+
+struct _EtiSyncTransport {
+    mobilesync_error_t (*start)(EtiSyncTransport *transport,
+                                const char *data_class,
+                                mobilesync_anchors_t anchors,
+                                uint64_t computer_data_class_version,
+                                mobilesync_sync_type_t *sync_type,
+                                uint64_t *device_data_class_version,
+                                char **error_description);
+    mobilesync_error_t (*get_all_records_from_device)(EtiSyncTransport *transport);
+    mobilesync_error_t (*get_changes_from_device)(EtiSyncTransport *transport);
+    mobilesync_error_t (*receive_changes)(EtiSyncTransport *transport,
+                                          plist_t *entities,
+                                          uint8_t *is_last_record);
+    mobilesync_error_t (*acknowledge_changes_from_device)(EtiSyncTransport *transport);
+    mobilesync_error_t (*ready_to_send_changes_from_computer)(EtiSyncTransport *transport);
+    mobilesync_error_t (*send_changes)(EtiSyncTransport *transport,
+                                       plist_t entities,
+                                       uint8_t is_last_record);
+    mobilesync_error_t (*remap_identifiers)(EtiSyncTransport *transport,
+                                            plist_t *mapping);
+    mobilesync_error_t (*clear_all_records_on_device)(EtiSyncTransport *transport);
+    mobilesync_error_t (*finish)(EtiSyncTransport *transport);
+    void (*free)(EtiSyncTransport *transport);
+};
+
+EtiSyncTransport *eti_sync_transport_new_mobilesync(idevice_t device,
+                                                    lockdownd_service_descriptor_t service,
+                                                    GError **error);
+
+#endif
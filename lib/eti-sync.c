@@ -19,16 +19,37 @@
 #include "eti-contact.h"
 #include "eti-contact-plist-builder.h"
 #include "eti-contact-plist-parser.h"
+#include "eti-mock-device.h"
 #include "eti-plist.h"
+#include "eti-queue.h"
+#include "eti-stats.h"
 #include "eti-sync.h"
+#include "eti-sync-journal.h"
+#include "eti-sync-recorder.h"
+#include "eti-sync-state.h"
+#include "eti-sync-transport.h"
 
 #include <glib-2.0/glib.h>
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/mobilesync.h>
 #include <libimobiledevice/lockdown.h>
+#include <stdlib.h>
+#include <string.h>
 
 static const uint64_t EDI_CLASS_STORAGE_VERSION = 106;
 
+/* number of batches queued between device I/O and the builder/parser thread */
+#define ETI_SYNC_PIPELINE_DEPTH 2
+
+/* Without an explicit limit, the number of contacts sent per message is
+ * adjusted after each of them (additive increase, multiplicative decrease)
+ * so that the device takes about ETI_SYNC_TARGET_LATENCY to process one.
+ */
+#define ETI_SYNC_TARGET_LATENCY (2 * G_USEC_PER_SEC)
+#define ETI_SYNC_INITIAL_BATCH_RECORDS 50
+#define ETI_SYNC_MIN_BATCH_RECORDS 10
+#define ETI_SYNC_BATCH_INCREMENT 10
+
 GQuark eti_sync_error_quark(void)
 {
     return g_quark_from_static_string("eti-sync-error-quark");
@@ -36,9 +57,149 @@ GQuark eti_sync_error_quark(void)
 
 struct _EtiSync {
     idevice_t idevice;
-    mobilesync_client_t msync;
+    EtiSyncTransport *transport;
+    char *udid;
+    EtiSyncState *state;
+    EtiSyncJournal *journal;
+    gboolean contacts_sent;
+    mobilesync_sync_type_t sync_type;
+    gchar *host_anchor;
+    gsize chunk_max_bytes;
+    guint chunk_max_records;
+    /* read by the builder thread, use atomic accesses */
+    gint batch_records;
+    gsize photo_batch_bytes;
+    EtiStats *stats;
 };
 
+/* Returns the UDIDs of the connected devices as a NULL-terminated array */
+gchar **eti_sync_list_devices(GError **error)
+{
+    char **devices;
+    int count;
+    gchar **udids;
+    int i;
+    idevice_error_t i_status;
+
+    i_status = idevice_get_device_list(&devices, &count);
+    if (IDEVICE_E_SUCCESS != i_status) {
+        g_set_error(error, ETI_SYNC_ERROR,
+                    ETI_SYNC_ERROR_IDEVICE_COMMUNICATION,
+                    "failed to get the list of connected devices");
+        return NULL;
+    }
+
+    udids = g_new0(gchar *, count + 1);
+    for (i = 0; i < count; i++)
+        udids[i] = g_strdup(devices[i]);
+    idevice_device_list_free(devices);
+
+    return udids;
+}
+
+/* libimobiledevice only supports one event subscriber per process, and
+ * calls it from its own thread. Events are forwarded to the main loop, which
+ * is also the only place where the set of connected devices is touched.
+ */
+struct DeviceWatch {
+    EtiSyncDeviceAddedFunc func;
+    gpointer user_data;
+    GHashTable *connected;
+};
+static struct DeviceWatch *device_watch = NULL;
+
+struct DeviceEvent {
+    gboolean added;
+    char *udid;
+};
+
+static gboolean dispatch_device_event(gpointer data)
+{
+    struct DeviceEvent *event;
+
+    event = (struct DeviceEvent *)data;
+    if (device_watch != NULL) {
+        if (!event->added) {
+            g_hash_table_remove(device_watch->connected, event->udid);
+        } else if (!g_hash_table_contains(device_watch->connected,
+                                          event->udid)) {
+            /* pairing generates more ADD events for the same device */
+            g_hash_table_add(device_watch->connected, g_strdup(event->udid));
+            device_watch->func(event->udid, device_watch->user_data);
+        }
+    }
+    g_free(event->udid);
+    g_free(event);
+
+    return FALSE;
+}
+
+static void device_event_cb(const idevice_event_t *event, void *user_data)
+{
+    struct DeviceEvent *device_event;
+
+    if ((event->event != IDEVICE_DEVICE_ADD)
+            && (event->event != IDEVICE_DEVICE_REMOVE))
+        return;
+
+    device_event = g_new0(struct DeviceEvent, 1);
+    device_event->added = (event->event == IDEVICE_DEVICE_ADD);
+    device_event->udid = g_strdup(event->udid);
+    g_idle_add(dispatch_device_event, device_event);
+}
+
+/* Calls @func from the default main loop each time a device is plugged in,
+ * including the devices which are already connected when this is called
+ */
+gboolean eti_sync_watch_devices(EtiSyncDeviceAddedFunc func,
+                                gpointer user_data, GError **error)
+{
+    idevice_error_t i_status;
+
+    g_return_val_if_fail(device_watch == NULL, FALSE);
+
+    device_watch = g_new0(struct DeviceWatch, 1);
+    device_watch->func = func;
+    device_watch->user_data = user_data;
+    device_watch->connected = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                    g_free, NULL);
+
+    i_status = idevice_event_subscribe(device_event_cb, NULL);
+    if (IDEVICE_E_SUCCESS != i_status) {
+        g_set_error(error, ETI_SYNC_ERROR,
+                    ETI_SYNC_ERROR_IDEVICE_COMMUNICATION,
+                    "failed to listen for device events");
+        eti_sync_unwatch_devices();
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void eti_sync_unwatch_devices(void)
+{
+    if (device_watch == NULL)
+        return;
+
+    idevice_event_unsubscribe();
+    g_hash_table_destroy(device_watch->connected);
+    g_free(device_watch);
+    device_watch = NULL;
+}
+
+/* Sets up what doesn't depend on how we talk to the device */
+static void eti_sync_init(EtiSync *sync)
+{
+    sync->stats = eti_stats_new();
+    sync->state = eti_sync_state_load(sync->udid);
+    sync->journal = eti_sync_journal_load(sync->udid,
+                                          eti_sync_state_get_records(sync->state));
+    sync->sync_type = MOBILESYNC_SYNC_TYPE_SLOW;
+    sync->batch_records = eti_sync_state_get_batch_records(sync->state);
+    if (sync->batch_records < ETI_SYNC_MIN_BATCH_RECORDS)
+        sync->batch_records = ETI_SYNC_INITIAL_BATCH_RECORDS;
+}
+
 EtiSync *eti_sync_new(const char *uuid, GError **error)
 {
     EtiSync *sync;
@@ -46,8 +207,8 @@ EtiSync *eti_sync_new(const char *uuid, GError **error)
    /* uint16_t port = 0; */
     idevice_error_t i_status;
     lockdownd_error_t l_status;
-    mobilesync_error_t m_status;
 	lockdownd_service_descriptor_t service = NULL; /* FIXME */
+    gint64 start;
 	
 	
 	
@@ -62,6 +223,16 @@ EtiSync *eti_sync_new(const char *uuid, GError **error)
         goto error;
     }
 
+    i_status = idevice_get_udid(sync->idevice, &sync->udid);
+    if (IDEVICE_E_SUCCESS != i_status) {
+        g_set_error(error, ETI_SYNC_ERROR,
+                    ETI_SYNC_ERROR_IDEVICE_COMMUNICATION,
+                    "failed to get device UDID\n");
+        goto error;
+    }
+    eti_sync_init(sync);
+
+    start = g_get_monotonic_time();
     l_status = lockdownd_client_new_with_handshake(sync->idevice, &lockdownd,
                                                    "eds-to-idevice");
     if (LOCKDOWN_E_SUCCESS != l_status) {
@@ -95,29 +266,111 @@ EtiSync *eti_sync_new(const char *uuid, GError **error)
 
 
 
-    m_status = mobilesync_client_new(sync->idevice, service, &sync->msync);
-    if (MOBILESYNC_E_SUCCESS != m_status) {
-        g_set_error(error, ETI_SYNC_ERROR,
-                    ETI_SYNC_ERROR_IDEVICE_COMMUNICATION,
-                    "failed to create mobilesync client\n");
+    sync->transport = eti_sync_transport_new_mobilesync(sync->idevice,
+                                                        service, error);
+    if (NULL == sync->transport)
         goto error;
-    }
 
     lockdownd_client_free(lockdownd);
+    eti_stats_add(sync->stats, "lockdownd handshake",
+                  g_get_monotonic_time() - start, 0, 0);
 
     return sync;
 
 error:
-    mobilesync_client_free(sync->msync);
     lockdownd_client_free(lockdownd);
     idevice_free(sync->idevice);
+    if (sync->journal != NULL)
+        eti_sync_journal_free(sync->journal);
+    if (sync->state != NULL)
+        eti_sync_state_free(sync->state);
+    if (sync->stats != NULL)
+        eti_stats_free(sync->stats);
+    free(sync->udid);
     g_free(sync);
     return NULL;
 }
 
+/* Synchronizes with an in-process fake device instead of a real one, see
+ * eti_mock_device_new(). Its sync state is stored under the "mock-device"
+ * UDID.
+ */
+EtiSync *eti_sync_new_mock(const char *fixture, guint latency_ms,
+                           GError **error)
+{
+    EtiSync *sync;
+
+    sync = g_new0(EtiSync, 1);
+    sync->transport = eti_mock_device_new(fixture, latency_ms, error);
+    if (NULL == sync->transport) {
+        g_free(sync);
+        return NULL;
+    }
+    sync->udid = strdup("mock-device");
+    eti_sync_init(sync);
+
+    return sync;
+}
+
+/* Time spent in each phase of the synchronization so far, owned by @sync */
+EtiStats *eti_sync_get_stats(EtiSync *sync)
+{
+    return sync->stats;
+}
+
+/* Saves everything exchanged with the device during this session to
+ * @filename, see eti-sync-recorder.h. Must be called before
+ * eti_sync_start_sync().
+ */
+void eti_sync_set_record_file(EtiSync *sync, const char *filename)
+{
+    sync->transport = eti_sync_recorder_new(sync->transport, filename);
+}
+
+/* Limits how much contact data is sent to the device in a single message,
+ * the main contact records are split in several messages when they go over
+ * either limit. 0 means no limit on the size, and an adaptive number of
+ * contacts.
+ */
+void eti_sync_set_chunk_limits(EtiSync *sync, gsize max_bytes,
+                               guint max_records)
+{
+    sync->chunk_max_bytes = max_bytes;
+    sync->chunk_max_records = max_records;
+}
+
+/* Sends the contact photos once the text of all the contacts is on the
+ * device, with at most @max_bytes of photo data per message. 0 sends them
+ * along with the rest of the main records.
+ */
+void eti_sync_set_photo_batch_size(EtiSync *sync, gsize max_bytes)
+{
+    sync->photo_batch_bytes = max_bytes;
+}
+
+/* A fast sync only sends the contacts whose fingerprint changed since the
+ * last sync, which assumes the device still has what we sent then. We can't
+ * ask the device which anchor it stored, but eti_sync_stop_sync() saves
+ * the host anchor the device acknowledged as both anchors, so they only
+ * differ (or are missing) when the state doesn't come from a completed
+ * sync and can't be trusted.
+ */
+static gboolean anchors_match(EtiSyncState *state)
+{
+    const char *device_anchor;
+    const char *host_anchor;
+
+    device_anchor = eti_sync_state_get_device_anchor(state);
+    host_anchor = eti_sync_state_get_host_anchor(state);
+    if ((device_anchor == NULL) || (host_anchor == NULL))
+        return FALSE;
+
+    return (strcmp(device_anchor, host_anchor) == 0);
+}
+
 gboolean eti_sync_start_sync(EtiSync *sync, GError **error)
 {
-    struct GDateTime;
+    GDateTime *now;
     gchar *cur_time_str;
     gchar *host_anchor;
     mobilesync_sync_type_t sync_type;
@@ -125,14 +378,23 @@ gboolean eti_sync_start_sync(EtiSync *sync, GError **error)
     mobilesync_anchors_t anchors;
     mobilesync_error_t m_status;
 	char *ERRor = NULL;
+    gint64 start;
 
-    g_get_real_time();
-    cur_time_str = g_date_time_format_iso8601(*GDateTime);
+    now = g_date_time_new_now_utc();
+    cur_time_str = g_date_time_format(now, "%Y-%m-%dT%H:%M:%SZ");
+    g_date_time_unref(now);
     host_anchor = g_strdup_printf("eti-%s", cur_time_str);
-    anchors = mobilesync_anchors_new(NULL, host_anchor);
-    g_free(host_anchor);
     g_free(cur_time_str);
 
+    /* libimobiledevice doesn't tell us which anchor the device stored for
+     * us, the device compares the anchor we present with the computer
+     * anchor it was given during the last completed sync, so that's what
+     * we persist as the device anchor. With no stored anchor, the device
+     * will ask for a slow sync.
+     */
+    anchors = mobilesync_anchors_new(eti_sync_state_get_device_anchor(sync->state),
+                                     host_anchor);
+
 	/* FIXME too few arguments to function ‘mobilesync_start’ */
     /*  m_status = mobilesync_start(sync->msync, "com.apple.Contacts", anchors, */
 	/* EDI_CLASS_STORAGE_VERSION, &sync_type, &device_data_class_version); */
@@ -142,9 +404,13 @@ gboolean eti_sync_start_sync(EtiSync *sync, GError **error)
 	/* *sync_type, uint64_t device_data_class_version, FIXME char error_description); TW 10-01-2016 */
 
 	
-    m_status = mobilesync_start ( sync->msync, "com.apple.Contacts", anchors,
-                                EDI_CLASS_STORAGE_VERSION,
-                                &sync_type, &device_data_class_version, &ERRor);
+    start = g_get_monotonic_time();
+    m_status = sync->transport->start(sync->transport, "com.apple.Contacts",
+                                      anchors, EDI_CLASS_STORAGE_VERSION,
+                                      &sync_type, &device_data_class_version,
+                                      &ERRor);
+    eti_stats_add(sync->stats, "mobilesync_start",
+                  g_get_monotonic_time() - start, 0, 0);
     if (MOBILESYNC_E_INVALID_ARG == m_status){
 	g_print("mobilesync-start-arg is invalid\n");
 	}
@@ -153,29 +419,199 @@ gboolean eti_sync_start_sync(EtiSync *sync, GError **error)
         g_set_error(error, ETI_SYNC_ERROR,
                     ETI_SYNC_ERROR_SYNCING,
                     "failed to start synchronization\n");
+        g_free(host_anchor);
+        free(ERRor);
         return FALSE;
     }
 
-#if 0
-    g_print("Sync type is ");
+    g_free(sync->host_anchor);
+    sync->host_anchor = host_anchor;
+    if ((MOBILESYNC_SYNC_TYPE_FAST == sync_type)
+            && !anchors_match(sync->state)) {
+        g_debug("stored anchors don't match, falling back to a slow sync");
+        sync_type = MOBILESYNC_SYNC_TYPE_SLOW;
+    }
+    sync->sync_type = sync_type;
+    if (MOBILESYNC_SYNC_TYPE_RESET == sync_type) {
+        /* the device dropped its records, the IDs we know are stale */
+        eti_sync_state_forget_records(sync->state);
+        eti_sync_journal_discard(sync->journal);
+    } else if (MOBILESYNC_SYNC_TYPE_SLOW == sync_type) {
+        /* every record has to be sent, but we can still send them with the
+         * IDs the device gave them so that they don't get duplicated
+         */
+        eti_sync_state_forget_contacts(sync->state);
+    }
+
     switch (sync_type) {
         case MOBILESYNC_SYNC_TYPE_SLOW:
-            g_print("slow\n");
+            g_debug("Sync type is slow");
             break;
         case MOBILESYNC_SYNC_TYPE_FAST:
-            g_print("fast\n");
+            g_debug("Sync type is fast");
             break;
         case MOBILESYNC_SYNC_TYPE_RESET:
-            g_print("reset\n");
+            g_debug("Sync type is reset");
             break;
     }
 
-    g_print("Device data class version is %"G_GUINT64_FORMAT"\n", device_data_class_version);
-#endif
+    g_debug("Device data class version is %"G_GUINT64_FORMAT, device_data_class_version);
 
     return TRUE;
 }
 
+/* The records received from the device are parsed by a worker thread so
+ * that the next mobilesync_receive_changes() can run while the previous
+ * batch is being parsed. Only the worker touches the parser until it's
+ * joined.
+ */
+struct ParseJob {
+    EtiContactPlistParser *parser;
+    EtiQueue *queue;
+    GError *error;
+    gint64 parse_time;
+    guint n_records;
+};
+
+static gpointer parse_device_records(gpointer data)
+{
+    struct ParseJob *job;
+    plist_t entities;
+
+    job = (struct ParseJob *)data;
+    while ((entities = eti_queue_pop(job->queue)) != NULL) {
+        gboolean parse_ok;
+        gint64 start;
+
+        start = g_get_monotonic_time();
+        parse_ok = eti_contact_plist_parser_parse(job->parser, entities,
+                                                  &job->error);
+        job->parse_time += g_get_monotonic_time() - start;
+        job->n_records += plist_dict_get_size(entities);
+        plist_free(entities);
+        if (!parse_ok) {
+            /* makes the receiving side stop as well */
+            eti_queue_close(job->queue);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static gboolean request_device_records(EtiSync *sync, GError **error)
+{
+    mobilesync_error_t m_status;
+
+    if (MOBILESYNC_SYNC_TYPE_FAST == sync->sync_type)
+        m_status = sync->transport->get_changes_from_device(sync->transport);
+    else
+        m_status = sync->transport->get_all_records_from_device(sync->transport);
+    if (MOBILESYNC_E_SUCCESS != m_status) {
+        g_set_error(error, ETI_SYNC_ERROR,
+                    ETI_SYNC_ERROR_READING,
+                    "failed to ask device for contacts\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gsize get_plist_size(EtiSync *sync, plist_t plist)
+{
+    if (!eti_stats_get_measure_bytes(sync->stats))
+        return 0;
+
+    return eti_plist_get_size(plist);
+}
+
+static void add_download_stats(EtiSync *sync, plist_t entities,
+                               gint64 start)
+{
+    eti_stats_add(sync->stats, "device download",
+                  g_get_monotonic_time() - start,
+                  plist_dict_get_size(entities),
+                  get_plist_size(sync, entities));
+}
+
+static void add_contact_ids(GHashTable *ids, plist_t entities)
+{
+    plist_dict_iter it = NULL;
+    char *key = NULL;
+    plist_t entity = NULL;
+
+    plist_dict_new_iter(entities, &it);
+    if (it == NULL)
+        return;
+
+    plist_dict_next_item(entities, it, &key, &entity);
+    while (key != NULL) {
+        char *entity_name;
+
+        entity_name = eti_plist_dict_get_string(entity,
+                                                "com.apple.syncservices.RecordEntityName");
+        if (g_strcmp0(entity_name, "com.apple.contacts.Contact") == 0)
+            g_hash_table_add(ids, g_strdup(key));
+        free(entity_name);
+        free(key);
+        key = NULL;
+        plist_dict_next_item(entities, it, &key, &entity);
+    }
+    free(it);
+}
+
+/* Lighter alternative to eti_sync_get_contacts() when the device contacts
+ * themselves aren't needed: the records still have to be received for the
+ * device to accept changes from the computer, but they are not parsed into
+ * EtiContact (and their photos aren't copied around). Returns the set of
+ * the device IDs of the contacts which were received.
+ */
+GHashTable *eti_sync_get_contact_ids(EtiSync *sync, GError **error)
+{
+    mobilesync_error_t m_status;
+    plist_t entities;
+    uint8_t is_last;
+    GHashTable *ids;
+    gint64 start;
+
+    start = g_get_monotonic_time();
+    if (!request_device_records(sync, error))
+        return NULL;
+
+    ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    do {
+        m_status = sync->transport->receive_changes(sync->transport,
+                                                    &entities, &is_last);
+        if (MOBILESYNC_E_SUCCESS != m_status) {
+            g_set_error(error, ETI_SYNC_ERROR,
+                        ETI_SYNC_ERROR_READING,
+                        "failed to read contacts from device\n");
+            g_hash_table_destroy(ids);
+            return NULL;
+        }
+
+        m_status = sync->transport->acknowledge_changes_from_device(sync->transport);
+        if (MOBILESYNC_E_SUCCESS != m_status) {
+            g_set_error(error, ETI_SYNC_ERROR,
+                        ETI_SYNC_ERROR_READING,
+                        "failed to acknowledge receiving contacts\n");
+            plist_free(entities);
+            g_hash_table_destroy(ids);
+            return NULL;
+        }
+
+        add_download_stats(sync, entities, start);
+        add_contact_ids(ids, entities);
+        plist_free(entities);
+        start = g_get_monotonic_time();
+    } while (!is_last);
+
+    if (MOBILESYNC_SYNC_TYPE_FAST != sync->sync_type)
+        eti_sync_state_prune_records(sync->state, ids);
+
+    return ids;
+}
+
 GHashTable *eti_sync_get_contacts(EtiSync *sync, GError **error)
 {
     mobilesync_error_t m_status;
@@ -183,6 +619,10 @@ GHashTable *eti_sync_get_contacts(EtiSync *sync, GError **error)
     uint8_t is_last;
     EtiContactPlistParser *parser;
     GHashTable *contacts;
+    struct ParseJob job;
+    GThread *thread;
+    gboolean receive_ok;
+    gint64 start;
 
     parser = eti_contact_plist_parser_new();
     if (NULL == parser) {
@@ -192,60 +632,100 @@ GHashTable *eti_sync_get_contacts(EtiSync *sync, GError **error)
         return NULL;
     }
 
-    m_status = mobilesync_get_all_records_from_device(sync->msync);
-    if (MOBILESYNC_E_SUCCESS != m_status) {
-        g_set_error(error, ETI_SYNC_ERROR,
-                    ETI_SYNC_ERROR_READING,
-                    "failed to ask device for contacts\n");
+    start = g_get_monotonic_time();
+    if (!request_device_records(sync, error)) {
         eti_contact_plist_parser_free(parser, TRUE);
         return NULL;
     }
 
+    memset(&job, 0, sizeof(job));
+    job.parser = parser;
+    job.queue = eti_queue_new(ETI_SYNC_PIPELINE_DEPTH,
+                              (GDestroyNotify)plist_free);
+    thread = g_thread_new("eti-parse", parse_device_records, &job);
+
+    receive_ok = TRUE;
     do {
-        m_status = mobilesync_receive_changes(sync->msync, &entities,
-                                              &is_last, NULL);
+        m_status = sync->transport->receive_changes(sync->transport,
+                                                    &entities, &is_last);
         if (MOBILESYNC_E_SUCCESS != m_status) {
             g_set_error(error, ETI_SYNC_ERROR,
                         ETI_SYNC_ERROR_READING,
                         "failed to read contacts from device\n");
-            eti_contact_plist_parser_free(parser, TRUE);
-            return NULL;
+            receive_ok = FALSE;
+            break;
         }
 
-        m_status = mobilesync_acknowledge_changes_from_device(sync->msync);
+        m_status = sync->transport->acknowledge_changes_from_device(sync->transport);
         if (MOBILESYNC_E_SUCCESS != m_status) {
             g_set_error(error, ETI_SYNC_ERROR,
                         ETI_SYNC_ERROR_READING,
                         "failed to acknowledge receiving contacts\n");
+            plist_free(entities);
             break;
         }
 
         eti_plist_dump(entities);
+        add_download_stats(sync, entities, start);
 
-        if (!eti_contact_plist_parser_parse(parser, entities, error))
+        if (!eti_queue_push(job.queue, entities)) {
+            /* the parser gave up */
+            plist_free(entities);
             break;
-        g_assert((error == NULL) || (*error == NULL));
-
-        plist_free(entities);
-        entities = NULL;
+        }
+        start = g_get_monotonic_time();
     } while (!is_last);
 
-    if (entities != NULL) {
-        plist_free(entities);
-        entities = NULL;
+    /* lets the worker parse what's still queued, then exit */
+    eti_queue_close(job.queue);
+    g_thread_join(thread);
+    eti_queue_free(job.queue);
+    eti_stats_add(sync->stats, "parse device records", job.parse_time,
+                  job.n_records, 0);
+
+    if (job.error != NULL) {
+        if ((error != NULL) && (*error == NULL))
+            g_propagate_error(error, job.error);
+        else
+            g_error_free(job.error);
+        receive_ok = FALSE;
     }
+
+    if (!receive_ok) {
+        eti_contact_plist_parser_free(parser, TRUE);
+        return NULL;
+    }
+
+    eti_stats_add(sync->stats, "orphaned device records", 0,
+                  eti_contact_plist_parser_finish(parser), 0);
     contacts = eti_contact_plist_parser_get_contacts(parser);
     eti_contact_plist_parser_free(parser, FALSE);
+    if (MOBILESYNC_SYNC_TYPE_FAST != sync->sync_type)
+        eti_sync_state_prune_records(sync->state, contacts);
+
     return contacts;
 }
 
+/* @records_name is used to report statistics about what was sent */
 static plist_t send_one(EtiSync *sync, plist_t entities,
-                        gboolean is_last, GError **error)
+                        gboolean is_last, const char *records_name,
+                        GError **error)
 {
     plist_t remapped_identifiers;
     mobilesync_error_t m_status;
+    gint64 start;
+    gsize size;
+    gchar *phase;
 
-    m_status = mobilesync_send_changes(sync->msync, entities, is_last, NULL);
+    eti_plist_dump(entities);
+
+    size = get_plist_size(sync, entities);
+    start = g_get_monotonic_time();
+    m_status = sync->transport->send_changes(sync->transport, entities, is_last);
+    phase = g_strdup_printf("send %s", records_name);
+    eti_stats_add(sync->stats, phase, g_get_monotonic_time() - start,
+                  plist_dict_get_size(entities), size);
+    g_free(phase);
     if (MOBILESYNC_E_SUCCESS != m_status) {
         g_set_error(error, ETI_SYNC_ERROR,
                     ETI_SYNC_ERROR_WRITING,
@@ -253,7 +733,15 @@ static plist_t send_one(EtiSync *sync, plist_t entities,
         return NULL;
     }
 
-    m_status = mobilesync_remap_identifiers(sync->msync, &remapped_identifiers);
+    start = g_get_monotonic_time();
+    remapped_identifiers = NULL;
+    m_status = sync->transport->remap_identifiers(sync->transport,
+                                                  &remapped_identifiers);
+    phase = g_strdup_printf("remap %s", records_name);
+    eti_stats_add(sync->stats, phase, g_get_monotonic_time() - start,
+                  (remapped_identifiers != NULL)?plist_dict_get_size(remapped_identifiers):0,
+                  0);
+    g_free(phase);
     if (MOBILESYNC_E_SUCCESS != m_status) {
     /*    g_set_error(error, ETI_SYNC_ERROR,
                     ETI_SYNC_ERROR_WRITING,
@@ -277,81 +765,791 @@ static plist_t send_one(EtiSync *sync, plist_t entities,
     return remapped_identifiers;
 }
 
-void eti_sync_send_contacts(EtiSync *sync, GHashTable *contacts,
-                            GError **error)
+/* Returns the contacts which must be sent to the device, indexed by the
+ * record ID to use for them: the ID the device gave them if it already knows
+ * them, their EDS UID otherwise. During a fast sync, only the contacts which
+ * changed since the last sync are returned. The fingerprints of the returned
+ * contacts are added to @fingerprints, indexed by EDS UID, and their EDS UID
+ * is added to @uids, indexed by record ID.
+ * Contacts which were completely sent during an interrupted session are
+ * skipped (but their fingerprint is added), the ones whose main record was
+ * sent are not added to @main_changes.
+ */
+static GHashTable *get_contacts_to_send(EtiSync *sync, GHashTable *contacts,
+                                        GHashTable *fingerprints,
+                                        GHashTable *uids,
+                                        GHashTable *main_changes)
 {
-    plist_t main_entities;
-    plist_t remapped_uids;
-    GList *plists;
-    GList *it;
-    mobilesync_error_t m_status;
+    GHashTable *changes;
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
 
-    m_status = mobilesync_ready_to_send_changes_from_computer(sync->msync);
-    if (MOBILESYNC_E_SUCCESS != m_status) {
-        g_set_error(error, ETI_SYNC_ERROR,
-                    ETI_SYNC_ERROR_WRITING,
-                    "device is not ready to receive new contacts");
-        return;
+    changes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_hash_table_iter_init(&iter, contacts);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const char *uid = (const char *)key;
+        EtiContact *contact = (EtiContact *)value;
+        gchar *fingerprint;
+        const char *device_id;
+
+        fingerprint = eti_contact_get_fingerprint(contact);
+        if ((MOBILESYNC_SYNC_TYPE_FAST == sync->sync_type)
+                && (g_strcmp0(fingerprint,
+                              eti_sync_state_get_fingerprint(sync->state,
+                                                             uid)) == 0)) {
+            g_free(fingerprint);
+            continue;
+        }
+        g_hash_table_insert(fingerprints, g_strdup(uid), fingerprint);
+
+        device_id = eti_sync_state_get_device_id(sync->state, uid);
+        if (device_id == NULL) {
+            g_hash_table_insert(changes, g_strdup(uid), contact);
+            g_hash_table_insert(main_changes, g_strdup(uid), contact);
+            g_hash_table_insert(uids, g_strdup(uid), g_strdup(uid));
+            continue;
+        }
+        if (eti_sync_journal_is_sent(sync->journal, uid, fingerprint))
+            continue;
+        g_hash_table_insert(changes, g_strdup(device_id), contact);
+        if (!eti_sync_journal_is_main_sent(sync->journal, uid, fingerprint))
+            g_hash_table_insert(main_changes, g_strdup(device_id), contact);
+        g_hash_table_insert(uids, g_strdup(device_id), g_strdup(uid));
     }
 
-    main_entities = eti_contact_plist_builder_build_main(contacts);
-    if (main_entities == NULL) {
-        g_set_error(error, ETI_SYNC_ERROR,
-                    ETI_SYNC_ERROR_SYNCING,
-                    "failed to read contacts from device");
+    return changes;
+}
+
+static guint get_batch_records(EtiSync *sync)
+{
+    if (sync->chunk_max_records != 0)
+        return sync->chunk_max_records;
+
+    return g_atomic_int_get(&sync->batch_records);
+}
+
+/* AIMD controller for the number of contacts per message. Messages which
+ * weren't full say nothing about whether the device could take more.
+ */
+static void adapt_batch_records(EtiSync *sync, guint records, gint64 latency)
+{
+    gint batch_records;
+
+    if (sync->chunk_max_records != 0)
+        return;
+
+    batch_records = g_atomic_int_get(&sync->batch_records);
+    if (latency > ETI_SYNC_TARGET_LATENCY)
+        batch_records = MAX(batch_records / 2, ETI_SYNC_MIN_BATCH_RECORDS);
+    else if (records >= (guint)batch_records)
+        batch_records += ETI_SYNC_BATCH_INCREMENT;
+    else
         return;
+    g_atomic_int_set(&sync->batch_records, batch_records);
+    eti_sync_state_set_batch_records(sync->state, batch_records);
+}
+
+static gboolean chunk_is_full(EtiSync *sync, guint records, gsize bytes)
+{
+    if (records >= get_batch_records(sync))
+        return TRUE;
+    if ((sync->chunk_max_bytes != 0) && (bytes > sync->chunk_max_bytes))
+        return TRUE;
+
+    return FALSE;
+}
+
+/* The plists are built by a worker thread while the main thread waits for
+ * the device to process the previous batch. The worker only reads
+ * @changes and the known record IDs, the main thread doesn't modify them
+ * while the worker is running.
+ */
+struct BuildJob {
+    EtiSync *sync;
+    const char *name;
+    GHashTable *changes;
+    /* record ID -> EDS UID, for the main records only */
+    GHashTable *uids;
+    /* leave the photos out of the main records */
+    gboolean text_only;
+    /* photo phase: chunks only limited by the photo data they hold */
+    gsize max_photo_bytes;
+    EtiQueue *queue;
+    gint64 build_time;
+    guint n_records;
+    gint64 wait_time;
+};
+
+static void build_job_init(struct BuildJob *job, EtiSync *sync,
+                           const char *name, GHashTable *changes)
+{
+    job->sync = sync;
+    job->name = name;
+    job->changes = changes;
+    job->uids = NULL;
+    job->text_only = FALSE;
+    job->max_photo_bytes = 0;
+    job->queue = eti_queue_new(ETI_SYNC_PIPELINE_DEPTH,
+                               (GDestroyNotify)plist_free);
+    job->build_time = 0;
+    job->n_records = 0;
+    job->wait_time = 0;
+}
+
+static void build_job_finish(struct BuildJob *job, GThread *thread)
+{
+    /* unblocks the worker if we stopped consuming early */
+    eti_queue_close(job->queue);
+    g_thread_join(thread);
+    eti_stats_add(job->sync->stats, job->name, job->build_time,
+                  job->n_records, 0);
+    eti_stats_add(job->sync->stats, "wait for builder", job->wait_time,
+                  0, 0);
+    eti_queue_free(job->queue);
+}
+
+static plist_t build_job_pop(struct BuildJob *job)
+{
+    plist_t plist;
+    gint64 start;
+
+    start = g_get_monotonic_time();
+    plist = eti_queue_pop(job->queue);
+    job->wait_time += g_get_monotonic_time() - start;
+
+    return plist;
+}
+
+static gboolean contact_has_photo(EtiContact *contact)
+{
+    const guchar *data;
+    size_t length;
+
+    eti_contact_get_photo(contact, &data, &length);
+
+    return (data != NULL) && (length != 0);
+}
+
+static gsize get_photo_size(EtiContact *contact)
+{
+    const guchar *data;
+    size_t length;
+
+    eti_contact_get_photo(contact, &data, &length);
+
+    return (data != NULL) ? length : 0;
+}
+
+static gboolean build_job_chunk_is_full(struct BuildJob *job, guint records,
+                                        gsize bytes)
+{
+    if (job->max_photo_bytes != 0)
+        return bytes > job->max_photo_bytes;
+
+    return chunk_is_full(job->sync, records, bytes);
+}
+
+static plist_t build_main_record(struct BuildJob *job, EtiContact *contact)
+{
+    if (job->text_only)
+        return eti_contact_plist_builder_build_contact_text(contact);
+
+    return eti_contact_plist_builder_build_contact(contact);
+}
+
+static gpointer build_main_records(gpointer data)
+{
+    struct BuildJob *job;
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+    plist_t chunk;
+    gsize chunk_bytes;
+    guint chunk_records;
+
+    job = (struct BuildJob *)data;
+    chunk = NULL;
+    chunk_bytes = 0;
+    chunk_records = 0;
+    g_hash_table_iter_init(&iter, job->changes);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const char *uid = (const char *)key;
+        EtiContact *contact = (EtiContact *)value;
+        plist_t main_info;
+        gsize size;
+        gint64 start;
+
+        start = g_get_monotonic_time();
+        main_info = build_main_record(job, contact);
+        job->build_time += g_get_monotonic_time() - start;
+        job->n_records++;
+        if (main_info == NULL) {
+            g_warning("couldn't create plist for %s", uid);
+            continue;
+        }
+        if (job->max_photo_bytes != 0)
+            size = get_photo_size(contact);
+        else if (job->text_only)
+            size = eti_contact_get_data_size(contact)
+                   - get_photo_size(contact);
+        else
+            size = eti_contact_get_data_size(contact);
+
+        if ((chunk != NULL)
+                && build_job_chunk_is_full(job, chunk_records,
+                                           chunk_bytes + size)) {
+            if (!eti_queue_push(job->queue, chunk)) {
+                plist_free(chunk);
+                plist_free(main_info);
+                return NULL;
+            }
+            chunk = NULL;
+            chunk_bytes = 0;
+            chunk_records = 0;
+        }
+        if (chunk == NULL)
+            chunk = plist_new_dict();
+        plist_dict_set_item(chunk, uid, main_info);
+        chunk_bytes += size;
+        chunk_records++;
     }
-    remapped_uids = send_one(sync, main_entities, FALSE, error);
-    if ((error != NULL) && (*error != NULL)) {
-        g_assert(remapped_uids == NULL);
+
+    /* the device expects the main records even when there are none */
+    if (chunk == NULL)
+        chunk = plist_new_dict();
+    if (!eti_queue_push(job->queue, chunk))
+        plist_free(chunk);
+    eti_queue_close(job->queue);
+
+    return NULL;
+}
+
+/* Marks the contacts of an acknowledged chunk as sent in the journal */
+static void journal_main_records(EtiSync *sync, plist_t chunk,
+                                 GHashTable *uids, GHashTable *deferred)
+{
+    plist_dict_iter it = NULL;
+    char *key = NULL;
+    plist_t entity = NULL;
+
+    plist_dict_new_iter(chunk, &it);
+    if (it == NULL)
         return;
+
+    plist_dict_next_item(chunk, it, &key, &entity);
+    while (key != NULL) {
+        const char *uid;
+
+        uid = g_hash_table_lookup(uids, key);
+        /* a resumed transfer must still send the photos */
+        if ((uid != NULL)
+                && ((deferred == NULL)
+                    || !g_hash_table_contains(deferred, key)))
+            eti_sync_journal_add_main(sync->journal, uid);
+        free(key);
+        key = NULL;
+        plist_dict_next_item(chunk, it, &key, &entity);
     }
-    plists = eti_contact_plist_builder_build_others(contacts, remapped_uids);
-    plist_free(main_entities);
-    plist_free(remapped_uids);
+    free(it);
+}
 
-    for (it = plists; it != NULL; it = it->next) {
-        remapped_uids = send_one(sync, it->data, (it->next == NULL), error);
-        if ((error != NULL) && (*error != NULL)) {
+/* Sends the main contact records, chunks are built at most
+ * ETI_SYNC_PIPELINE_DEPTH ahead of the one being sent so that only a few
+ * of them are held in memory.
+ */
+static gboolean send_main_job(EtiSync *sync, struct BuildJob *job,
+                              const char *records_name, GHashTable *deferred,
+                              GError **error)
+{
+    GThread *thread;
+    plist_t chunk;
+    GError *send_error = NULL;
+
+    thread = g_thread_new("eti-build-main", build_main_records, job);
+    while ((chunk = build_job_pop(job)) != NULL) {
+        plist_t remapped_uids;
+        gint64 start;
+
+        start = g_get_monotonic_time();
+        remapped_uids = send_one(sync, chunk, FALSE, records_name,
+                                 &send_error);
+        if (send_error != NULL) {
             g_assert(remapped_uids == NULL);
+            plist_free(chunk);
             break;
         }
-        if (remapped_uids != NULL) {
+        /* photo batches are sized in bytes, they don't tell how many
+         * contacts the device can take at once
+         */
+        if (job->max_photo_bytes == 0)
+            adapt_batch_records(sync, plist_dict_get_size(chunk),
+                                g_get_monotonic_time() - start);
+        eti_sync_journal_add_remaps(sync->journal, remapped_uids);
+        journal_main_records(sync, chunk, job->uids, deferred);
+        eti_sync_journal_commit(sync->journal);
+        plist_free(chunk);
+        /* the worker doesn't look at the record IDs while building the
+         * main records, we can update them right away
+         */
+        eti_sync_state_add_records(sync->state, remapped_uids);
+        if (remapped_uids != NULL)
             plist_free(remapped_uids);
+    }
+    build_job_finish(job, thread);
+
+    if (send_error != NULL) {
+        g_propagate_error(error, send_error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* With @deferred set, the contacts it lists are sent without their photo,
+ * send_photos() sends them again in full afterwards.
+ */
+static gboolean send_main_records(EtiSync *sync, GHashTable *changes,
+                                  GHashTable *uids, GHashTable *deferred,
+                                  GError **error)
+{
+    struct BuildJob job;
+
+    build_job_init(&job, sync, "build main records", changes);
+    job.uids = uids;
+    job.text_only = (deferred != NULL);
+
+    return send_main_job(sync, &job, "main records", deferred, error);
+}
+
+/* Returns the contacts of @main_changes which have a photo, keyed by their
+ * record ID in @main_changes, or NULL when photos aren't deferred.
+ */
+static GHashTable *get_deferred_photos(EtiSync *sync,
+                                       GHashTable *main_changes)
+{
+    GHashTable *deferred;
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+
+    if (sync->photo_batch_bytes == 0)
+        return NULL;
+
+    deferred = g_hash_table_new(g_str_hash, g_str_equal);
+    g_hash_table_iter_init(&iter, main_changes);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (contact_has_photo((EtiContact *)value))
+            g_hash_table_insert(deferred, key, value);
+    }
+
+    return deferred;
+}
+
+/* Resends the main records of the @deferred contacts, photo included, now
+ * that the new ones have been given a device ID. Nothing in the records is
+ * left out as the device replaces a record with what it receives.
+ */
+static gboolean send_photos(EtiSync *sync, GHashTable *deferred,
+                            GHashTable *uids, GError **error)
+{
+    struct BuildJob job;
+    GHashTable *photo_changes;
+    GHashTable *photo_uids;
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+    gboolean sent;
+
+    if (g_hash_table_size(deferred) == 0)
+        return TRUE;
+
+    photo_changes = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                          g_free, NULL);
+    photo_uids = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                       g_free, g_free);
+    g_hash_table_iter_init(&iter, deferred);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const char *uid;
+        const char *device_id;
+
+        uid = g_hash_table_lookup(uids, key);
+        if (uid == NULL)
+            continue;
+        device_id = eti_sync_state_get_device_id(sync->state, uid);
+        if (device_id == NULL) {
+            g_warning("no device ID for %s, not sending its photo", uid);
+            continue;
         }
+        g_hash_table_insert(photo_changes, g_strdup(device_id), value);
+        g_hash_table_insert(photo_uids, g_strdup(device_id), g_strdup(uid));
     }
 
-    g_list_foreach(plists, (GFunc)plist_free, NULL);
+    build_job_init(&job, sync, "build photo records", photo_changes);
+    job.uids = photo_uids;
+    job.max_photo_bytes = sync->photo_batch_bytes;
+    sent = send_main_job(sync, &job, "photo records", NULL, error);
+
+    g_hash_table_destroy(photo_uids);
+    g_hash_table_destroy(photo_changes);
+
+    return sent;
+}
+
+static gpointer build_other_records(gpointer data)
+{
+    struct BuildJob *job;
+    EtiRemapIndex *records;
+    GList *plists;
+    GList *it;
+    gint64 start;
+
+    job = (struct BuildJob *)data;
+    records = eti_sync_state_get_records(job->sync->state);
+    start = g_get_monotonic_time();
+    plists = eti_contact_plist_builder_build_others(job->changes, records);
+    job->build_time += g_get_monotonic_time() - start;
+    for (it = plists; it != NULL; it = it->next)
+        job->n_records += plist_dict_get_size(it->data);
+
+    /* the queue takes the plists in order, those it doesn't get once the
+     * sender gave up are freed here
+     */
+    for (it = plists; it != NULL; it = it->next) {
+        if (!eti_queue_push(job->queue, it->data))
+            break;
+    }
+    for (; it != NULL; it = it->next)
+        plist_free(it->data);
     g_list_free(plists);
+    eti_queue_close(job->queue);
+
+    return NULL;
+}
+
+static void add_record_ids(GHashTable *ids, plist_t entities)
+{
+    plist_dict_iter it = NULL;
+    char *key = NULL;
+    plist_t entity = NULL;
+
+    plist_dict_new_iter(entities, &it);
+    if (it == NULL)
+        return;
+
+    plist_dict_next_item(entities, it, &key, &entity);
+    while (key != NULL) {
+        g_hash_table_add(ids, g_strdup(key));
+        free(key);
+        key = NULL;
+        plist_dict_next_item(entities, it, &key, &entity);
+    }
+    free(it);
+}
+
+/* The IDs of the field records which are sent are added to @sent_ids */
+static gboolean send_other_records(EtiSync *sync, GHashTable *changes,
+                                   GHashTable *sent_ids, GError **error)
+{
+    struct BuildJob job;
+    GThread *thread;
+    GList *remaps;
+    GList *it;
+    guint i;
+    GError *send_error = NULL;
+
+    remaps = NULL;
+    build_job_init(&job, sync, "build fields", changes);
+    thread = g_thread_new("eti-build-others", build_other_records, &job);
+    for (i = 0; i < ETI_CONTACT_PLIST_BUILDER_N_OTHERS; i++) {
+        plist_t plist;
+        plist_t remapped_uids;
+
+        plist = build_job_pop(&job);
+        if (plist == NULL) {
+            g_set_error(&send_error, ETI_SYNC_ERROR,
+                        ETI_SYNC_ERROR_SYNCING,
+                        "failed to build contact details");
+            break;
+        }
+        add_record_ids(sent_ids, plist);
+        remapped_uids = send_one(sync, plist, FALSE, "fields", &send_error);
+        plist_free(plist);
+        if (send_error != NULL) {
+            g_assert(remapped_uids == NULL);
+            break;
+        }
+        eti_sync_journal_add_remaps(sync->journal, remapped_uids);
+        eti_sync_journal_add_fields(sync->journal, i);
+        eti_sync_journal_commit(sync->journal);
+        if (remapped_uids != NULL)
+            remaps = g_list_prepend(remaps, remapped_uids);
+    }
+    build_job_finish(&job, thread);
+
+    /* the worker reads the record IDs, only update them once it's done */
+    for (it = remaps; it != NULL; it = it->next) {
+        eti_sync_state_add_records(sync->state, it->data);
+        plist_free(it->data);
+    }
+    g_list_free(remaps);
+
+    if (send_error != NULL) {
+        g_propagate_error(error, send_error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Records to delete from the device: the contacts which are not in EDS
+ * anymore with all their fields, and the fields of the modified contacts
+ * which weren't sent again (eg a removed phone number). They are only
+ * forgotten once the device acknowledged the deletion.
+ */
+struct Deletions {
+    GHashTable *contacts;
+    GHashTable *changes;
+    GHashTable *sent_ids;
+    GHashTable *deleted_owners;
+    GPtrArray *deleted_contacts;
+    GPtrArray *deleted_fields;
+    plist_t entities;
+};
+
+static void find_deleted_contact(gpointer key, gpointer value,
+                                 gpointer user_data)
+{
+    struct Deletions *deletions = (struct Deletions *)user_data;
+    gchar *owner;
+
+    owner = eti_contact_plist_builder_get_field_owner(key);
+    if (owner != NULL) {
+        g_free(owner);
+        return;
+    }
+    if (g_hash_table_contains(deletions->contacts, key))
+        return;
+
+    g_ptr_array_add(deletions->deleted_contacts, g_strdup(key));
+    g_hash_table_add(deletions->deleted_owners, g_strdup(value));
+    eti_contact_plist_builder_add_deleted(deletions->entities, value);
+}
+
+static void find_deleted_field(gpointer key, gpointer value,
+                               gpointer user_data)
+{
+    struct Deletions *deletions = (struct Deletions *)user_data;
+    gchar *owner;
+    gboolean deleted;
+
+    owner = eti_contact_plist_builder_get_field_owner(key);
+    if (owner == NULL)
+        return;
+
+    if (g_hash_table_contains(deletions->deleted_owners, owner))
+        deleted = TRUE;
+    else
+        /* new fields were sent with their local ID */
+        deleted = (g_hash_table_contains(deletions->changes, owner)
+                   && !g_hash_table_contains(deletions->sent_ids, value)
+                   && !g_hash_table_contains(deletions->sent_ids, key));
+    g_free(owner);
+
+    if (deleted) {
+        g_ptr_array_add(deletions->deleted_fields, g_strdup(key));
+        eti_contact_plist_builder_add_deleted(deletions->entities, value);
+    }
+}
+
+static void deletions_init(struct Deletions *deletions, EtiSync *sync,
+                           GHashTable *contacts, GHashTable *changes,
+                           GHashTable *sent_ids)
+{
+    deletions->contacts = contacts;
+    deletions->changes = changes;
+    deletions->sent_ids = sent_ids;
+    deletions->deleted_owners = g_hash_table_new_full(g_str_hash,
+                                                      g_str_equal,
+                                                      g_free, NULL);
+    deletions->deleted_contacts = g_ptr_array_new_with_free_func(g_free);
+    deletions->deleted_fields = g_ptr_array_new_with_free_func(g_free);
+    deletions->entities = plist_new_dict();
+    eti_remap_index_foreach(eti_sync_state_get_records(sync->state),
+                            find_deleted_contact, deletions);
+}
+
+static void deletions_clear(struct Deletions *deletions)
+{
+    g_hash_table_destroy(deletions->deleted_owners);
+    g_ptr_array_free(deletions->deleted_contacts, TRUE);
+    g_ptr_array_free(deletions->deleted_fields, TRUE);
+    if (deletions->entities != NULL)
+        plist_free(deletions->entities);
+}
+
+/* Last message of the session, sent even when it's empty so that the
+ * device knows we're done
+ */
+static gboolean send_deletions(EtiSync *sync, struct Deletions *deletions,
+                               GError **error)
+{
+    plist_t remapped_uids;
+    GError *send_error = NULL;
+
+    eti_remap_index_foreach(eti_sync_state_get_records(sync->state),
+                            find_deleted_field, deletions);
+    remapped_uids = send_one(sync, deletions->entities, TRUE, "deletions",
+                             &send_error);
+    plist_free(deletions->entities);
+    deletions->entities = NULL;
+    if (send_error != NULL) {
+        g_propagate_error(error, send_error);
+        return FALSE;
+    }
+    if (remapped_uids != NULL)
+        plist_free(remapped_uids);
+
+    return TRUE;
+}
+
+static void deletions_apply(struct Deletions *deletions, EtiSync *sync)
+{
+    guint i;
+
+    for (i = 0; i < deletions->deleted_contacts->len; i++)
+        eti_sync_state_forget_contact(sync->state,
+                                      g_ptr_array_index(deletions->deleted_contacts, i));
+    for (i = 0; i < deletions->deleted_fields->len; i++)
+        eti_sync_state_forget_record(sync->state,
+                                     g_ptr_array_index(deletions->deleted_fields, i));
+}
+
+void eti_sync_send_contacts(EtiSync *sync, GHashTable *contacts,
+                            GError **error)
+{
+    GHashTable *changes;
+    GHashTable *main_changes;
+    GHashTable *uids;
+    GHashTable *fingerprints;
+    GHashTable *sent_ids;
+    GHashTable *deferred;
+    struct Deletions deletions;
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+    gint64 start;
+    mobilesync_error_t m_status;
+
+    m_status = sync->transport->ready_to_send_changes_from_computer(sync->transport);
+    if (MOBILESYNC_E_SUCCESS != m_status) {
+        g_set_error(error, ETI_SYNC_ERROR,
+                    ETI_SYNC_ERROR_WRITING,
+                    "device is not ready to receive new contacts");
+        return;
+    }
+
+    fingerprints = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                         g_free, g_free);
+    uids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    main_changes = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                         g_free, NULL);
+    changes = get_contacts_to_send(sync, contacts, fingerprints,
+                                   uids, main_changes);
+    sent_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    deferred = get_deferred_photos(sync, main_changes);
+    /* must be computed before the new contacts get their device IDs */
+    deletions_init(&deletions, sync, contacts, changes, sent_ids);
+    g_print("%u of %u contacts changed, %u deleted\n",
+            g_hash_table_size(changes), g_hash_table_size(contacts),
+            deletions.deleted_contacts->len);
+
+    if (!eti_sync_journal_begin(sync->journal, uids, fingerprints, error))
+        goto out;
+
+    /* text records first, the photos are most of the data to send */
+    start = g_get_monotonic_time();
+    if (!send_main_records(sync, main_changes, uids, deferred, error))
+        goto out;
+    if (!send_other_records(sync, changes, sent_ids, error))
+        goto out;
+    if ((deferred != NULL)
+            && !send_photos(sync, deferred, uids, error))
+        goto out;
+    if (!send_deletions(sync, &deletions, error))
+        goto out;
+    /* the build and send phases overlap, so this is less than their sum */
+    eti_stats_add(sync->stats, "send contacts",
+                  g_get_monotonic_time() - start,
+                  g_hash_table_size(changes), 0);
+
+    g_hash_table_iter_init(&iter, fingerprints);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        eti_sync_state_set_fingerprint(sync->state, key, value);
+    deletions_apply(&deletions, sync);
+    sync->contacts_sent = TRUE;
+
+out:
+    deletions_clear(&deletions);
+    if (deferred != NULL)
+        g_hash_table_destroy(deferred);
+    g_hash_table_destroy(sent_ids);
+    g_hash_table_destroy(main_changes);
+    g_hash_table_destroy(changes);
+    g_hash_table_destroy(uids);
+    g_hash_table_destroy(fingerprints);
 }
 
 void eti_sync_wipe_all_contacts(EtiSync *sync, GError **error)
 {
     mobilesync_error_t m_status;
-    m_status = mobilesync_clear_all_records_on_device(sync->msync);
+    m_status = sync->transport->clear_all_records_on_device(sync->transport);
     if (MOBILESYNC_E_SUCCESS != m_status) {
         g_set_error(error, ETI_SYNC_ERROR,
                     ETI_SYNC_ERROR_SYNCING,
                     "failed to clear all contacts from device");
+        return;
     }
+    eti_sync_state_forget_records(sync->state);
+    eti_sync_journal_discard(sync->journal);
 
     return;
 }
 
 void eti_sync_stop_sync(EtiSync *sync, GError **error)
 {
-    mobilesync_finish(sync->msync);
-    mobilesync_client_free(sync->msync);
-    sync->msync = NULL;
+    mobilesync_error_t m_status;
+    gint64 start;
+
+    start = g_get_monotonic_time();
+    m_status = sync->transport->finish(sync->transport);
+    eti_stats_add(sync->stats, "mobilesync_finish",
+                  g_get_monotonic_time() - start, 0, 0);
+    if ((MOBILESYNC_E_SUCCESS == m_status) && (sync->host_anchor != NULL)) {
+        /* the device now knows our new anchor, next sync can be a fast one */
+        eti_sync_state_set_anchors(sync->state, sync->host_anchor,
+                                   sync->host_anchor);
+        eti_sync_state_save(sync->state, error);
+        /* the journal still helps resuming if nothing was sent */
+        if (sync->contacts_sent)
+            eti_sync_journal_discard(sync->journal);
+    }
+    sync->transport->free(sync->transport);
+    sync->transport = NULL;
     idevice_free(sync->idevice);
     sync->idevice = NULL;
 }
 
 void eti_sync_free(EtiSync *sync)
 {
-    if (NULL != sync->msync)
+    if (NULL != sync->transport)
         eti_sync_stop_sync(sync, NULL);
 
     idevice_free(sync->idevice);
+    eti_sync_journal_free(sync->journal);
+    eti_sync_state_free(sync->state);
+    eti_stats_free(sync->stats);
+    free(sync->udid);
+    g_free(sync->host_anchor);
     g_free(sync);
 }
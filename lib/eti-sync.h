@@ -20,6 +20,8 @@
 
 #include <glib-2.0/glib.h>
 
+#include "eti-stats.h"
+
 #define ETI_SYNC_ERROR eti_sync_error_quark()
 
 typedef enum {
@@ -33,9 +35,23 @@ typedef enum {
 typedef struct _EtiSync EtiSync;
 
 GQuark eti_sync_error_quark(void);
+gchar **eti_sync_list_devices(GError **error);
+
+typedef void (*EtiSyncDeviceAddedFunc)(const char *udid, gpointer user_data);
+gboolean eti_sync_watch_devices(EtiSyncDeviceAddedFunc func,
+                                gpointer user_data, GError **error);
+void eti_sync_unwatch_devices(void);
 EtiSync *eti_sync_new(const char *uuid, GError **error);
+EtiSync *eti_sync_new_mock(const char *fixture, guint latency_ms,
+                           GError **error);
+EtiStats *eti_sync_get_stats(EtiSync *sync);
+void eti_sync_set_record_file(EtiSync *sync, const char *filename);
+void eti_sync_set_chunk_limits(EtiSync *sync, gsize max_bytes,
+                               guint max_records);
+void eti_sync_set_photo_batch_size(EtiSync *sync, gsize max_bytes);
 gboolean eti_sync_start_sync(EtiSync *sync, GError **error);
 GHashTable *eti_sync_get_contacts(EtiSync *sync, GError **error);
+GHashTable *eti_sync_get_contact_ids(EtiSync *sync, GError **error);
 void eti_sync_wipe_all_contacts(EtiSync *sync, GError **error);
 void eti_sync_send_contacts(EtiSync *sync, GHashTable *contacts,
                             GError **error);
@@ -123,7 +123,8 @@ static void add_photo(EtiContact *contact, EContact *econtact)
 
     if (photo != NULL) {
         /* various limitations here, E_CONTACT_PHOTO_TYPE_URI isn't
-         * handled, we don't check at all what format the photo is in, ...
+         * handled, ... The format and size of the photo are dealt with
+         * later, see eti-photo.c
          */
         if (photo->type == E_CONTACT_PHOTO_TYPE_INLINED) {
             eti_contact_set_photo_from_data(contact, photo->data.inlined.data,
@@ -392,7 +393,8 @@ static void convert_im_contacts(EContact *econtact, EtiContact *contact)
                    contact, "skype", ETI_CONTACT_FIELD_TYPE_WORK);
 }
 
-EtiContact *eti_contact_from_econtact(EContact *econtact)
+/* @arena can be NULL, see eti_contact_new_person_in_arena() */
+EtiContact *eti_contact_from_econtact(EContact *econtact, EtiArena *arena)
 {
     EtiContact *contact;
     EContactName *name;
@@ -412,9 +414,9 @@ EtiContact *eti_contact_from_econtact(EContact *econtact)
     company_name = E_contact_get_string(econtact, E_CONTACT_ORG);
 
     if ((name == NULL) && (company_name != NULL)) {
-        contact = eti_contact_new_company(company_name);
+        contact = eti_contact_new_company_in_arena(arena, company_name);
     } else {
-        contact = eti_contact_new_person(NULL, NULL);
+        contact = eti_contact_new_person_in_arena(arena, NULL, NULL);
         add_names(contact, econtact, name);
         e_contact_name_free(name);
     }
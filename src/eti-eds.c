@@ -186,3 +186,155 @@ const gchar *uid;
 
 }
 
+
+/* Converted contacts of an addressbook, kept up to date by listening to the
+ * changes EDS reports on a book view. The view signals are emitted from the
+ * main loop, so the cache must only be used from the main loop thread.
+ */
+struct _EtiEdsCache {
+    EBookClient *client;
+    EBookClientView *view;
+    GHashTable *contacts;
+    EtiPhotoPrep *photo_prep;
+};
+
+/* The contacts are replaced one by one for as long as the cache lives, so
+ * they own their memory rather than pinning a shared arena
+ */
+static void eti_eds_cache_add_contacts(EtiEdsCache *cache,
+                                       const GSList *e_contacts)
+{
+    const GSList *it;
+
+    for (it = e_contacts; it != NULL; it = it->next) {
+        EContact *e_contact;
+        EtiContact *contact;
+        gchar *uid;
+
+        e_contact = E_CONTACT(it->data);
+        uid = eti_eds_get_econtact_uid(e_contact);
+        if (uid == NULL) {
+            g_warning("EContact UID was NULL, fallback needed");
+            continue;
+        }
+        contact = eti_contact_from_econtact(e_contact, NULL);
+        if (contact == NULL) {
+            g_hash_table_remove(cache->contacts, uid);
+            g_free(uid);
+            continue;
+        }
+        if (cache->photo_prep != NULL)
+            eti_photo_prep_convert(cache->photo_prep, contact);
+        g_hash_table_replace(cache->contacts, uid, contact);
+    }
+}
+
+static void objects_added_cb(EBookClientView *view,
+                             const GSList *e_contacts,
+                             gpointer user_data)
+{
+    eti_eds_cache_add_contacts((EtiEdsCache *)user_data, e_contacts);
+}
+
+static void objects_modified_cb(EBookClientView *view,
+                                const GSList *e_contacts,
+                                gpointer user_data)
+{
+    eti_eds_cache_add_contacts((EtiEdsCache *)user_data, e_contacts);
+}
+
+static void objects_removed_cb(EBookClientView *view,
+                               const GSList *uids,
+                               gpointer user_data)
+{
+    EtiEdsCache *cache = (EtiEdsCache *)user_data;
+    const GSList *it;
+
+    for (it = uids; it != NULL; it = it->next)
+        g_hash_table_remove(cache->contacts, (const gchar *)it->data);
+}
+
+/* @photo_prep can be NULL to keep the photos as they are in EDS, it's not
+ * owned by the cache and must outlive it
+ */
+EtiEdsCache *eti_eds_cache_new(EBookClient *client, EtiPhotoPrep *photo_prep,
+                               GError **error)
+{
+    EtiEdsCache *cache;
+    GSList *e_contacts;
+    EBookQuery *query;
+    gchar *query_string;
+    gboolean view_ok;
+
+    cache = g_new0(EtiEdsCache, 1);
+    cache->client = g_object_ref(client);
+    cache->contacts = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            g_free,
+                                            (GDestroyNotify)eti_contact_free);
+
+    query = e_book_query_any_field_contains("");
+    query_string = e_book_query_to_string(query);
+    e_book_query_unref(query);
+    view_ok = e_book_client_get_view_sync(client, query_string, &cache->view,
+                                          NULL, error);
+    g_free(query_string);
+    if (!view_ok) {
+        g_prefix_error(error, "Failed to watch addressbook changes: ");
+        eti_eds_cache_free(cache);
+        return NULL;
+    }
+
+    /* The view is started before the contacts are read, so that nothing
+     * changed in between goes unnoticed. Its signals are only handled
+     * once the main loop runs, after the read: the changes which were
+     * already part of it are applied again, which is harmless.
+     */
+    e_book_client_view_set_flags(cache->view, E_BOOK_CLIENT_VIEW_FLAGS_NONE,
+                                 NULL);
+    g_signal_connect(cache->view, "objects-added",
+                     G_CALLBACK(objects_added_cb), cache);
+    g_signal_connect(cache->view, "objects-modified",
+                     G_CALLBACK(objects_modified_cb), cache);
+    g_signal_connect(cache->view, "objects-removed",
+                     G_CALLBACK(objects_removed_cb), cache);
+    e_book_client_view_start(cache->view, error);
+    if ((error != NULL) && (*error != NULL)) {
+        g_prefix_error(error, "Failed to watch addressbook changes: ");
+        eti_eds_cache_free(cache);
+        return NULL;
+    }
+
+    e_contacts = eti_eds_get_contacts(client, NULL, error);
+    if ((error != NULL) && (*error != NULL)) {
+        eti_eds_cache_free(cache);
+        return NULL;
+    }
+    eti_eds_cache_add_contacts(cache, e_contacts);
+    g_slist_free_full(e_contacts, g_object_unref);
+    /* converted one by one as they change from now on */
+    if (photo_prep != NULL)
+        eti_photo_prep_convert_all(photo_prep, cache->contacts);
+    cache->photo_prep = photo_prep;
+
+    return cache;
+}
+
+/* The returned table is owned by the cache and changes whenever the main
+ * loop runs
+ */
+GHashTable *eti_eds_cache_get_contacts(EtiEdsCache *cache)
+{
+    return cache->contacts;
+}
+
+void eti_eds_cache_free(EtiEdsCache *cache)
+{
+    if (cache->view != NULL) {
+        g_signal_handlers_disconnect_by_data(cache->view, cache);
+        e_book_client_view_stop(cache->view, NULL);
+        g_object_unref(cache->view);
+    }
+    g_hash_table_destroy(cache->contacts);
+    g_object_unref(cache->client);
+    g_free(cache);
+}
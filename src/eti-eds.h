@@ -21,6 +21,7 @@
 #include <glib-2.0/glib.h>
 #include <evolution-data-server/libebook/libebook.h>
 #include "eti-contact.h"
+#include "eti-photo.h"
 
 #define ETI_EBOOK_ERROR eti_ebook_error_quark()
 
@@ -36,7 +37,13 @@ GSList *eti_eds_get_contacts(EBookClient *client,
                             GError **error);
 EBookClient *eti_eds_open_addressbook(void);
 char *eti_eds_get_econtact_uid(EContact *econtact);
-EtiContact *eti_contact_from_econtact(EContact *econtact);
+EtiContact *eti_contact_from_econtact(EContact *econtact, EtiArena *arena);
 void eti_eds_dump_addressbooks(void);
 
+typedef struct _EtiEdsCache EtiEdsCache;
+EtiEdsCache *eti_eds_cache_new(EBookClient *client, EtiPhotoPrep *photo_prep,
+                               GError **error);
+GHashTable *eti_eds_cache_get_contacts(EtiEdsCache *cache);
+void eti_eds_cache_free(EtiEdsCache *cache);
+
 #endif
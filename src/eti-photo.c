@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2020 Timothy Ward <gtwa001@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "eti-contact.h"
+#include "eti-photo.h"
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib-2.0/glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+/* Shrinks the contact photos before they are sent: photos larger than
+ * max_edge pixels on either side are downscaled, and whatever isn't already
+ * a small enough JPEG is recompressed to JPEG. Photos which can't be
+ * decoded are sent unchanged.
+ *
+ * Results are cached in $XDG_CACHE_HOME/eds-to-idevice/photos/, one file
+ * per source photo named after its SHA1 and max_edge. An empty file means
+ * the photo is sent as it is. Files for photos which no contact has
+ * anymore are removed after converting all the contacts.
+ */
+#define ETI_PHOTO_JPEG_QUALITY "85"
+#define ETI_PHOTO_THREADS 4
+
+struct _EtiPhotoPrep {
+    guint max_edge;
+    char *cache_dir;
+    GMutex lock;
+    /* SHA1 of the photos converted since the last
+     * eti_photo_prep_convert_all()
+     */
+    GHashTable *used;
+};
+
+struct DecodeInfo {
+    guint max_edge;
+    gboolean scaled;
+};
+
+EtiPhotoPrep *eti_photo_prep_new(guint max_edge)
+{
+    EtiPhotoPrep *prep;
+
+    prep = g_new0(EtiPhotoPrep, 1);
+    prep->max_edge = max_edge;
+    prep->cache_dir = g_build_filename(g_get_user_cache_dir(),
+                                       "eds-to-idevice", "photos", NULL);
+    g_mkdir_with_parents(prep->cache_dir, 0700);
+    g_mutex_init(&prep->lock);
+    prep->used = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    return prep;
+}
+
+void eti_photo_prep_free(EtiPhotoPrep *prep)
+{
+    g_hash_table_destroy(prep->used);
+    g_mutex_clear(&prep->lock);
+    g_free(prep->cache_dir);
+    g_free(prep);
+}
+
+/* lets the loader downscale while decoding, which is much cheaper for
+ * JPEGs than scaling the full size image afterwards
+ */
+static void size_prepared_cb(GdkPixbufLoader *loader, int width, int height,
+                             gpointer user_data)
+{
+    struct DecodeInfo *info = (struct DecodeInfo *)user_data;
+    guint edge;
+
+    edge = MAX(width, height);
+    if ((edge == 0) || (edge <= info->max_edge))
+        return;
+
+    gdk_pixbuf_loader_set_size(loader,
+                               MAX(1, (guint64)width * info->max_edge / edge),
+                               MAX(1, (guint64)height * info->max_edge / edge));
+    info->scaled = TRUE;
+}
+
+/* JPEG has no transparency, put transparent photos on a white background */
+static GdkPixbuf *flatten(GdkPixbuf *pixbuf)
+{
+    GdkPixbuf *flat;
+    int width;
+    int height;
+
+    if (!gdk_pixbuf_get_has_alpha(pixbuf))
+        return g_object_ref(pixbuf);
+
+    width = gdk_pixbuf_get_width(pixbuf);
+    height = gdk_pixbuf_get_height(pixbuf);
+    flat = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+    gdk_pixbuf_fill(flat, 0xffffffff);
+    gdk_pixbuf_composite(pixbuf, flat, 0, 0, width, height, 0, 0, 1, 1,
+                         GDK_INTERP_NEAREST, 255);
+
+    return flat;
+}
+
+/* Returns NULL when the photo should be sent as it is */
+static gchar *prepare_photo(EtiPhotoPrep *prep, const guchar *data,
+                            gsize length, gsize *prepared_length)
+{
+    GdkPixbufLoader *loader;
+    GdkPixbuf *pixbuf;
+    struct DecodeInfo info;
+    gchar *format;
+    gchar *prepared;
+    gboolean decoded;
+
+    info.max_edge = prep->max_edge;
+    info.scaled = FALSE;
+    loader = gdk_pixbuf_loader_new();
+    g_signal_connect(loader, "size-prepared",
+                     G_CALLBACK(size_prepared_cb), &info);
+    decoded = gdk_pixbuf_loader_write(loader, data, length, NULL);
+    /* must be closed even after a failure */
+    decoded = gdk_pixbuf_loader_close(loader, NULL) && decoded;
+    pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+    if (!decoded || (pixbuf == NULL)) {
+        g_object_unref(loader);
+        return NULL;
+    }
+
+    format = NULL;
+    if (gdk_pixbuf_loader_get_format(loader) != NULL)
+        format = gdk_pixbuf_format_get_name(gdk_pixbuf_loader_get_format(loader));
+    if (!info.scaled && (g_strcmp0(format, "jpeg") == 0)) {
+        g_free(format);
+        g_object_unref(loader);
+        return NULL;
+    }
+    g_free(format);
+
+    pixbuf = flatten(pixbuf);
+    g_object_unref(loader);
+    prepared = NULL;
+    if (!gdk_pixbuf_save_to_buffer(pixbuf, &prepared, prepared_length,
+                                   "jpeg", NULL,
+                                   "quality", ETI_PHOTO_JPEG_QUALITY, NULL))
+        prepared = NULL;
+    g_object_unref(pixbuf);
+
+    /* recompressing a photo of the right size isn't always a win */
+    if ((prepared != NULL) && !info.scaled && (*prepared_length >= length)) {
+        g_free(prepared);
+        return NULL;
+    }
+
+    return prepared;
+}
+
+void eti_photo_prep_convert(EtiPhotoPrep *prep, EtiContact *contact)
+{
+    const guchar *data;
+    gsize length;
+    gchar *checksum;
+    gchar *basename;
+    gchar *filename;
+    gchar *prepared;
+    gsize prepared_length;
+
+    eti_contact_get_photo(contact, &data, &length);
+    if ((data == NULL) || (length == 0))
+        return;
+
+    checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA1, data, length);
+    g_mutex_lock(&prep->lock);
+    g_hash_table_add(prep->used, g_strdup(checksum));
+    g_mutex_unlock(&prep->lock);
+    basename = g_strdup_printf("%s-%u.jpg", checksum, prep->max_edge);
+    filename = g_build_filename(prep->cache_dir, basename, NULL);
+    g_free(basename);
+    g_free(checksum);
+
+    if (!g_file_get_contents(filename, &prepared, &prepared_length, NULL)) {
+        prepared = prepare_photo(prep, data, length, &prepared_length);
+        /* failing to write the cache only means doing this again */
+        if (prepared != NULL)
+            g_file_set_contents(filename, prepared, prepared_length, NULL);
+        else
+            g_file_set_contents(filename, "", 0, NULL);
+    }
+    g_free(filename);
+
+    if ((prepared != NULL) && (prepared_length != 0))
+        eti_contact_set_photo_from_data(contact, (const guchar *)prepared,
+                                        prepared_length);
+    g_free(prepared);
+}
+
+static void convert_one(gpointer data, gpointer user_data)
+{
+    eti_photo_prep_convert((EtiPhotoPrep *)user_data, (EtiContact *)data);
+}
+
+/* Removes the cached conversions of photos which weren't converted since
+ * the last eti_photo_prep_convert_all(), whatever their max_edge
+ */
+static void prune_cache(EtiPhotoPrep *prep)
+{
+    GDir *dir;
+    const gchar *name;
+
+    dir = g_dir_open(prep->cache_dir, 0, NULL);
+    if (dir == NULL)
+        return;
+
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        const char *dash;
+        gchar *checksum;
+        gboolean used;
+
+        dash = strchr(name, '-');
+        if (dash == NULL)
+            continue;
+        checksum = g_strndup(name, dash - name);
+        used = g_hash_table_contains(prep->used, checksum);
+        g_free(checksum);
+        if (!used) {
+            gchar *filename;
+
+            filename = g_build_filename(prep->cache_dir, name, NULL);
+            g_unlink(filename);
+            g_free(filename);
+        }
+    }
+    g_dir_close(dir);
+}
+
+/* Converts the photos of @contacts on a thread pool, each contact is only
+ * touched by one thread. Returns once they are all done. @contacts must be
+ * all the contacts, the cache is pruned of the photos none of them has.
+ */
+void eti_photo_prep_convert_all(EtiPhotoPrep *prep, GHashTable *contacts)
+{
+    GThreadPool *pool;
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_remove_all(prep->used);
+    pool = g_thread_pool_new(convert_one, prep, ETI_PHOTO_THREADS, FALSE,
+                             NULL);
+    g_hash_table_iter_init(&iter, contacts);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        g_thread_pool_push(pool, value, NULL);
+    g_thread_pool_free(pool, FALSE, TRUE);
+    prune_cache(prep);
+}
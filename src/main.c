@@ -21,7 +21,9 @@
 #include "eti-eds.h"
 #include "eti-plist.h"
 #include "eti-sync.h"
+#include "eti-sync-recorder.h"
 #include <glib-2.0/glib.h>
+#include <string.h>
 
 
 
@@ -44,39 +46,97 @@ struct _EtiOptions {
     gboolean save_photos;
     gboolean wipe_contacts;
     gboolean list_addressbooks;
-    gchar *idevice_uuid;
+    gint chunk_size;
+    gint chunk_records;
+    gboolean all_devices;
+    gboolean daemon;
+    gchar *stats;
+    gboolean mock_device;
+    gchar *mock_fixture;
+    gint mock_latency;
+    gchar *record_file;
+    gchar *replay_file;
+    gint bench_parser;
+    gint bench_builder;
+    gint photo_size;
+    gint photos_last;
+    gint fake_contacts;
+    gchar **idevice_uuids;
     gchar *addressbook_uri;
 };
 typedef struct _EtiOptions EtiOptions;
 
 static void eti_options_free(EtiOptions *options)
 {
-    g_free(options->idevice_uuid);
+    g_strfreev(options->idevice_uuids);
+    g_free(options->stats);
+    g_free(options->mock_fixture);
+    g_free(options->record_file);
+    g_free(options->replay_file);
  /*   g_free(options->addressbook_uri); */
     g_free(options);
 }
 
 
+static gboolean parse_stats_option(const gchar *option_name,
+                                   const gchar *value,
+                                   gpointer data, GError **error)
+{
+    EtiOptions *options = (EtiOptions *)data;
+
+    if (value == NULL)
+        value = "table";
+    if ((g_strcmp0(value, "table") != 0) && (g_strcmp0(value, "json") != 0)) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                    "invalid value for %s: %s (expected table or json)",
+                    option_name, value);
+        return FALSE;
+    }
+    g_free(options->stats);
+    options->stats = g_strdup(value);
+
+    return TRUE;
+}
+
 static EtiOptions *parse_command_line(int argc, char **argv, GError **error)
 {
     GOptionContext *context;
+    GOptionGroup *group;
     gboolean parsing_ok;
 
     EtiOptions *options = g_new0(EtiOptions, 1);
     GOptionEntry entries[] =
       {
           { "transfer", 't', 0, G_OPTION_ARG_NONE, &options->transfer, "Transfer contacts to the device [default: false]", NULL },
-          { "uuid", 'u', 0, G_OPTION_ARG_STRING, &options->idevice_uuid, "uuid of the device to use [default: autodetected]", "M" },
+          { "uuid", 'u', 0, G_OPTION_ARG_STRING_ARRAY, &options->idevice_uuids, "uuid of the device to use, can be repeated to sync several devices in parallel [default: autodetected]", "M" },
+          { "all-devices", 'a', 0, G_OPTION_ARG_NONE, &options->all_devices, "Sync all the connected devices in parallel [default: off]", NULL },
  /*         { "uid", 'f', 0, G_OPTION_ARG_STRING, &options->addressbook_uid, "uid of the addressbook to use [default: system default]", "uid" }, */
+          { "daemon", 'D', 0, G_OPTION_ARG_NONE, &options->daemon, "Keep running and transfer contacts to the devices given with --uuid (or any device with --all-devices) as soon as they are plugged in [default: off]", NULL },
           { "list-addressbooks", 'l', 0, G_OPTION_ARG_NONE, &options->list_addressbooks, "list the name and UIDs of all available addressbooks", NULL},
           { "save-photos", 'p', 0, G_OPTION_ARG_NONE, &options->save_photos, NULL },
           { "delete-all-contacts", 0, 0, G_OPTION_ARG_NONE, &options->wipe_contacts, "Delete all contacts on the device (DESTRUCTIVE!!) [default: off]", NULL },
           { "debug", 'd', 0, G_OPTION_ARG_NONE, &options->debug, "Dump all XML transfers between the host and the device [default: off]", NULL },
+          { "chunk-size", 0, 0, G_OPTION_ARG_INT, &options->chunk_size, "Maximum size in kB of contact data sent to the device in one message [default: unlimited]", "KB" },
+          { "chunk-records", 0, 0, G_OPTION_ARG_INT, &options->chunk_records, "Maximum number of contacts sent to the device in one message [default: adapted to the device speed]", "N" },
+          { "mock-device", 0, 0, G_OPTION_ARG_NONE, &options->mock_device, "Synchronize with an in-process fake device instead of a real one [default: off]", NULL },
+          { "mock-fixture", 0, 0, G_OPTION_ARG_FILENAME, &options->mock_fixture, "plist file with the records the fake device starts with [default: none]", "FILE" },
+          { "mock-latency", 0, 0, G_OPTION_ARG_INT, &options->mock_latency, "Delay in ms added by the fake device to each message [default: 0]", "MS" },
+          { "record", 0, 0, G_OPTION_ARG_FILENAME, &options->record_file, "Save everything exchanged with the device to FILE, several devices get one FILE.<uuid> each [default: off]", "FILE" },
+          { "replay", 0, 0, G_OPTION_ARG_FILENAME, &options->replay_file, "Parse and rebuild the records of a session saved with --record, print the time it took and exit", "FILE" },
+          { "bench-parser", 0, 0, G_OPTION_ARG_INT, &options->bench_parser, "With --replay, only parse the records received from the device N times and print the time it took", "N" },
+          { "bench-builder", 0, 0, G_OPTION_ARG_INT, &options->bench_builder, "Build the records of the contacts sent in the --replay session, or of --fake-contacts, N times and print the time it took and the allocations made if configured with --enable-alloc-count", "N" },
+          { "photo-size", 0, 0, G_OPTION_ARG_INT, &options->photo_size, "Downscale contact photos larger than PX pixels and send them as JPEG [default: unchanged]", "PX" },
+          { "photos-last", 0, 0, G_OPTION_ARG_INT, &options->photos_last, "Send the contact photos after the text of all the contacts, with at most KB of photos per message [default: off]", "KB" },
+          { "fake-contacts", 0, 0, G_OPTION_ARG_INT, &options->fake_contacts, "Transfer N generated contacts instead of the evolution ones [default: off]", "N" },
+          { "stats", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, parse_stats_option, "Print the time spent in each phase as a table, or as JSON with --stats=json [default: off]", "table|json" },
           { NULL }
       };
 
     context = g_option_context_new ("Transfer evolution-data-server contacts to an iOS device");
-    g_option_context_add_main_entries(context, entries, NULL);
+    /* the main group passes the options to parse_stats_option() */
+    group = g_option_group_new(NULL, NULL, NULL, options, NULL);
+    g_option_group_add_entries(group, entries);
+    g_option_context_set_main_group(context, group);
     parsing_ok = g_option_context_parse(context, &argc, &argv, error);
     g_option_context_free(context);
     if (!parsing_ok) {
@@ -87,13 +147,21 @@ static EtiOptions *parse_command_line(int argc, char **argv, GError **error)
     return options;
 }
 
-static EtiContact *create_test_contact(void)
+static EtiContact *create_test_contact(guint index)
 {
-    EtiContact *contact = eti_contact_new_person("John", "Doe");
+    EtiContact *contact;
     GDateTime *birthday;
+    gchar *last_name;
+    gchar *phone_number;
+
+    last_name = g_strdup_printf("Doe%u", index);
+    contact = eti_contact_new_person("John", last_name);
+    g_free(last_name);
 
+    phone_number = g_strdup_printf("+666%06u", index);
     eti_contact_add_phone_number(contact, ETI_CONTACT_PHONE_NUMBER_TYPE_MOBILE,
-                                 NULL, "+666666666");
+                                 NULL, phone_number);
+    g_free(phone_number);
     eti_contact_add_email(contact, ETI_CONTACT_FIELD_TYPE_HOME,
                           NULL, "nobody@nowhere.com");
     birthday = g_date_time_new_utc(2010, 9, 9, 10, 9, 0);
@@ -103,20 +171,39 @@ static EtiContact *create_test_contact(void)
     return contact;
 }
 
+/* Stand-in for the EDS contacts when benchmarking */
+static GHashTable *create_test_contacts(guint count)
+{
+    GHashTable *contacts;
+    guint i;
+
+    contacts = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                     g_free,
+                                     (GDestroyNotify)eti_contact_free);
+    for (i = 0; i < count; i++)
+        g_hash_table_insert(contacts, g_strdup_printf("fake-%u", i),
+                            create_test_contact(i));
+
+    return contacts;
+}
+
 static GHashTable *eds_to_eti_contacts(GSList *e_contacts)
 {
     GSList *it;
     GHashTable *contacts;
+    EtiArena *arena;
 
     contacts = g_hash_table_new_full(g_str_hash, g_str_equal,
                                      g_free,
                                      (GDestroyNotify)eti_contact_free);
+    /* the contacts hold a reference on it */
+    arena = eti_arena_new();
     for (it = e_contacts; it != NULL; it = it->next) {
         EContact *e_contact;
         EtiContact *contact;
 
         e_contact = (EContact *)it->data;
-        contact = eti_contact_from_econtact(e_contact);
+        contact = eti_contact_from_econtact(e_contact, arena);
         if (contact != NULL) {
             gchar *uid;
 
@@ -128,6 +215,7 @@ static GHashTable *eds_to_eti_contacts(GSList *e_contacts)
             g_hash_table_insert(contacts, uid, contact);
         }
     }
+    eti_arena_unref(arena);
 
     return contacts;
 }
@@ -168,15 +256,15 @@ static void save_photos(GHashTable *table)
     g_list_free(values);
 }
 
-static gboolean transfer_eds_contacts(EtiSync *sync,
-                                      const char *addressbook_uri,
-                                      GError **error)
+static GHashTable *read_eds_contacts(const char *addressbook_uri,
+                                     guint photo_size, EtiStats *stats,
+                                     GError **error)
 {
 
 GSList *e_contacts = NULL;
 GHashTable *contacts = NULL;
-gboolean success = FALSE;
 EBookClient *client;
+gint64 start;
 
 
    /* FIXME Remove test printf statements or include for debugging purpose */
@@ -186,60 +274,442 @@ EBookClient *client;
 	/* Original code used addressbook uri to access address books */
 	/* Have to return source or EBookClient or IUD????? for addressbooks here maybe */
 
+	 start = g_get_monotonic_time();
 	 client = eti_eds_open_addressbook();
+	 eti_stats_add(stats, "EDS open", g_get_monotonic_time() - start, 0, 0);
 
      /* FIXME This error message code needs updating or removed as appropriate */
 
 /*   if ((addressbook == NULL) || ((error != NULL) && (*error != NULL))) {
         g_prefix_error(error, "Couldn't open addressbook: ");
 
-		g_print("test1\n");
         goto out;
     } */
-	g_print("test2\n");
+    start = g_get_monotonic_time();
     e_contacts = eti_eds_get_contacts((EBookClient *) client, NULL, error);
+    eti_stats_add(stats, "EDS query", g_get_monotonic_time() - start,
+                  g_slist_length(e_contacts), 0);
     if ((error != NULL) && (*error != NULL)) {
         g_prefix_error(error,
                        "Error retrieving contacts from evolution addressbook: ");
-        g_print("test3\n");
 		goto out;
     }
     if (e_contacts == NULL) {
-        g_prefix_error(error, "No contacts in evolution addressbook");
-        g_print("test4\n");
+        g_set_error(error, ETI_EBOOK_ERROR, ETI_EBOOK_ERROR_QUERY,
+                    "No contacts in evolution addressbook");
 		goto out;
     }
-	g_print("test5\n");
+    start = g_get_monotonic_time();
     contacts = eds_to_eti_contacts(e_contacts);
-	g_print("test6\n");
-    eti_sync_send_contacts(sync, contacts, error);
-    if ((NULL != error) && (*error != NULL)){
-    	g_print("test7\n");
-		goto out;
-	}
-    success = TRUE;
+    eti_stats_add(stats, "EDS conversion", g_get_monotonic_time() - start,
+                  g_hash_table_size(contacts), 0);
+
+    if (photo_size > 0) {
+        EtiPhotoPrep *photo_prep;
+
+        start = g_get_monotonic_time();
+        photo_prep = eti_photo_prep_new(photo_size);
+        eti_photo_prep_convert_all(photo_prep, contacts);
+        eti_photo_prep_free(photo_prep);
+        eti_stats_add(stats, "photo preparation",
+                      g_get_monotonic_time() - start,
+                      g_hash_table_size(contacts), 0);
+    }
 
 out:
-	g_print("test8\n");
     if (e_contacts != NULL) {
         g_slist_foreach(e_contacts, (GFunc)g_object_unref, NULL);
         g_slist_free(e_contacts);
     }
-    if (contacts != NULL)
-        g_hash_table_destroy(contacts);
 
  /*   if (client != NULL)
         g_object_unref(G_OBJECT(addressbook)); */
 
-    return success;
+    return contacts;
 }
 
-int main(int argc, char **argv)
+static gboolean transfer_eds_contacts(EtiSync *sync, GHashTable *contacts,
+                                      GError **error)
+{
+    eti_sync_send_contacts(sync, contacts, error);
+    if ((NULL != error) && (*error != NULL))
+		return FALSE;
+
+    return TRUE;
+}
+
+/* One synchronization session with one device, several of them can run in
+ * parallel, in which case they share the same read-only EDS contacts.
+ */
+struct _EtiDeviceJob {
+    const EtiOptions *options;
+    const char *uuid;
+    GHashTable *eds_contacts;
+    GError *error;
+    gint64 elapsed;
+    gchar *stats;
+};
+typedef struct _EtiDeviceJob EtiDeviceJob;
+
+static gchar *format_stats(const EtiOptions *options, EtiStats *stats,
+                           const char *name)
+{
+    gchar *title;
+    gchar *formatted;
+
+    if (g_strcmp0(options->stats, "json") == 0)
+        return eti_stats_to_json(stats);
+
+    title = g_strdup_printf("Statistics for %s:",
+                            (name != NULL)?name:"default device");
+    formatted = eti_stats_format(stats, title);
+    g_free(title);
+
+    return formatted;
+}
+
+static gchar *get_record_file(const EtiOptions *options, const char *uuid)
+{
+    gboolean several_devices;
+
+    several_devices = options->all_devices || options->daemon
+                      || ((options->idevice_uuids != NULL)
+                          && (g_strv_length(options->idevice_uuids) > 1));
+    if (several_devices && (uuid != NULL))
+        return g_strdup_printf("%s.%s", options->record_file, uuid);
+
+    return g_strdup(options->record_file);
+}
+
+static gboolean sync_device(EtiDeviceJob *job)
 {
+    const EtiOptions *options = job->options;
     EtiSync *sync;
-    GError *error = NULL;
     GHashTable *contacts;
+    gint64 start;
+
+    start = g_get_monotonic_time();
+
+	g_print("uuid = %s\n", job->uuid);
+    if (options->mock_device)
+        sync = eti_sync_new_mock(options->mock_fixture,
+                                 MAX(options->mock_latency, 0), &job->error);
+    else
+        sync = eti_sync_new(job->uuid, &job->error);
+    if (NULL == sync) {
+        g_prefix_error(&job->error, "failed to create sync object: ");
+        goto out;
+    }
+    if (options->record_file != NULL) {
+        gchar *record_file;
+
+        record_file = get_record_file(options, job->uuid);
+        eti_sync_set_record_file(sync, record_file);
+        g_free(record_file);
+    }
+    eti_stats_set_measure_bytes(eti_sync_get_stats(sync),
+                                options->stats != NULL);
+    eti_sync_set_chunk_limits(sync,
+                              MAX(options->chunk_size, 0) * 1024,
+                              MAX(options->chunk_records, 0));
+    eti_sync_set_photo_batch_size(sync, MAX(options->photos_last, 0) * 1024);
+
+    eti_sync_start_sync(sync, &job->error);
+    if (job->error != NULL) {
+        g_prefix_error(&job->error, "failed to start synchronization: ");
+        goto out;
+    }
+
+    if (options->wipe_contacts) {
+        g_print("All contacts will be deleted from your device in 5 seconds\n");
+        g_print("Press Ctrl+C to interrupt now\n");
+        g_usleep(5*G_USEC_PER_SEC);
+        eti_sync_wipe_all_contacts(sync, &job->error);
+        if (job->error != NULL) {
+            g_prefix_error(&job->error, "failed to delete all contacts: ");
+            goto out;
+        }
+    }
+
+    /* the device contacts are only needed to save their photos, don't
+     * bother parsing them otherwise
+     */
+    if (options->save_photos)
+        contacts = eti_sync_get_contacts(sync, &job->error);
+    else
+        contacts = eti_sync_get_contact_ids(sync, &job->error);
+    if ((contacts != NULL) && options->save_photos)
+        save_photos(contacts);
+
+    if (contacts != NULL)
+        g_hash_table_destroy(contacts);
+    contacts = NULL;
+    if (NULL != job->error) {
+        g_prefix_error(&job->error, "failed to get contacts: ");
+        goto out;
+    }
+
+    if (options->transfer) {
+        gboolean transfer_successful;
+        transfer_successful = transfer_eds_contacts(sync, job->eds_contacts,
+                                                    &job->error);
+        if (!transfer_successful) {
+            g_prefix_error(&job->error, "failed to transfer contacts: ");
+            goto out;
+        }
+    }
+
+    eti_sync_stop_sync(sync, &job->error);
+
+out:
+    if ((sync != NULL) && (options->stats != NULL))
+        job->stats = format_stats(options, eti_sync_get_stats(sync),
+                                  job->uuid);
+    if (sync != NULL)
+        eti_sync_free(sync);
+    job->elapsed = g_get_monotonic_time() - start;
+
+    return (job->error == NULL);
+}
+
+static gpointer sync_device_thread(gpointer data)
+{
+    sync_device((EtiDeviceJob *)data);
+
+    return NULL;
+}
+
+static gboolean report_device_job(EtiDeviceJob *job)
+{
+    const char *uuid;
+
+    uuid = (job->uuid != NULL)?job->uuid:"default device";
+    /* JSON statistics are printed all at once by main() */
+    if ((job->stats != NULL) && (g_strcmp0(job->options->stats, "json") != 0)) {
+        g_print("%s", job->stats);
+        g_free(job->stats);
+        job->stats = NULL;
+    }
+    if (job->error != NULL) {
+        g_print("%s: %s (%"G_GINT64_FORMAT" ms)\n", uuid,
+                job->error->message, job->elapsed / 1000);
+        g_clear_error(&job->error);
+        return FALSE;
+    }
+
+    g_print("%s: synchronized in %"G_GINT64_FORMAT" ms\n", uuid,
+            job->elapsed / 1000);
+    return TRUE;
+}
+
+/* Prints one JSON document with the statistics of the EDS phases (if
+ * @eds_stats isn't NULL) and of each device
+ */
+static void print_json_stats(EtiStats *eds_stats,
+                             EtiDeviceJob *jobs, guint n_jobs)
+{
+    GString *json;
+    gchar *eds_json;
+    guint i;
+
+    json = g_string_new("{ ");
+    if (eds_stats != NULL) {
+        eds_json = eti_stats_to_json(eds_stats);
+        g_string_append_printf(json, "\"eds\": %s, ", eds_json);
+        g_free(eds_json);
+    }
+    g_string_append(json, "\"devices\": { ");
+    for (i = 0; i < n_jobs; i++) {
+        if (jobs[i].stats == NULL)
+            continue;
+        g_string_append_printf(json, "%s\"%s\": %s",
+                               (json->str[json->len - 2] == '{')?"":", ",
+                               (jobs[i].uuid != NULL)?jobs[i].uuid:"default",
+                               jobs[i].stats);
+        g_free(jobs[i].stats);
+        jobs[i].stats = NULL;
+    }
+    g_string_append(json, " } }\n");
+    g_print("%s", json->str);
+    g_string_free(json, TRUE);
+}
+
+/* In daemon mode, the addressbook connection and the converted contacts
+ * stay around between syncs so that a device can be synced as soon as it
+ * is plugged in, without paying for EDS startup and contact conversion
+ * each time.
+ */
+struct _EtiDaemon {
+    const EtiOptions *options;
+    EtiEdsCache *cache;
+    EtiPhotoPrep *photo_prep;
+};
+typedef struct _EtiDaemon EtiDaemon;
+
+static gboolean is_known_device(const EtiOptions *options, const char *udid)
+{
+    guint i;
+
+    if (options->all_devices)
+        return TRUE;
+    if (options->idevice_uuids == NULL)
+        return FALSE;
+    for (i = 0; options->idevice_uuids[i] != NULL; i++) {
+        if (g_strcmp0(options->idevice_uuids[i], udid) == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Runs from the main loop, so the contact cache can't change while the
+ * device is being synced
+ */
+static void device_added(const char *udid, gpointer user_data)
+{
+    EtiDaemon *daemon = (EtiDaemon *)user_data;
+    EtiDeviceJob job;
+
+    if (!is_known_device(daemon->options, udid)) {
+        g_print("ignoring unknown device %s\n", udid);
+        return;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.options = daemon->options;
+    job.uuid = udid;
+    job.eds_contacts = eti_eds_cache_get_contacts(daemon->cache);
+    sync_device(&job);
+    report_device_job(&job);
+    if (job.stats != NULL)
+        print_json_stats(NULL, &job, 1);
+}
+
+static gboolean run_daemon(EtiOptions *options, GError **error)
+{
+    EtiDaemon daemon;
+    EBookClient *client;
+    GMainLoop *loop;
+
+    if (!options->all_devices && (options->idevice_uuids == NULL)) {
+        g_set_error(error, ETI_SYNC_ERROR, ETI_SYNC_ERROR_FAILED,
+                    "--daemon needs --uuid or --all-devices");
+        return FALSE;
+    }
+    /* there's no point in running as a daemon without transferring */
+    options->transfer = TRUE;
+
+    client = eti_eds_open_addressbook();
+    if (client == NULL) {
+        g_set_error(error, ETI_EBOOK_ERROR, ETI_EBOOK_ERROR_ADDRESSBOOK,
+                    "Couldn't open addressbook");
+        return FALSE;
+    }
+
+    daemon.options = options;
+    daemon.photo_prep = NULL;
+    if (options->photo_size > 0)
+        daemon.photo_prep = eti_photo_prep_new(options->photo_size);
+    daemon.cache = eti_eds_cache_new(client, daemon.photo_prep, error);
+    g_object_unref(client);
+    if (daemon.cache == NULL) {
+        if (daemon.photo_prep != NULL)
+            eti_photo_prep_free(daemon.photo_prep);
+        return FALSE;
+    }
+
+    if (!eti_sync_watch_devices(device_added, &daemon, error)) {
+        eti_eds_cache_free(daemon.cache);
+        if (daemon.photo_prep != NULL)
+            eti_photo_prep_free(daemon.photo_prep);
+        return FALSE;
+    }
+
+    g_print("waiting for devices...\n");
+    loop = g_main_loop_new(NULL, FALSE);
+    g_main_loop_run(loop);
+    g_main_loop_unref(loop);
+
+    eti_sync_unwatch_devices();
+    eti_eds_cache_free(daemon.cache);
+    if (daemon.photo_prep != NULL)
+        eti_photo_prep_free(daemon.photo_prep);
+
+    return TRUE;
+}
+
+static gchar **get_device_uuids(EtiOptions *options, GError **error)
+{
+    if (options->all_devices)
+        return eti_sync_list_devices(error);
+
+    return g_strdupv(options->idevice_uuids);
+}
+
+static void print_bench_stats(const EtiOptions *options, EtiStats *stats,
+                              const char *name)
+{
+    gchar *formatted;
+
+    formatted = format_stats(options, stats, name);
+    g_print("%s", formatted);
+    if (g_strcmp0(options->stats, "json") == 0)
+        g_print("\n");
+    g_free(formatted);
+}
+
+/* the statistics are what replaying is for, they are printed even without
+ * --stats
+ */
+static gboolean replay_session(const EtiOptions *options, GError **error)
+{
+    EtiStats *stats;
+    gboolean replay_ok;
+
+    stats = eti_stats_new();
+    if (options->bench_parser > 0)
+        replay_ok = eti_sync_recorder_bench_parser(options->replay_file,
+                                                   options->bench_parser,
+                                                   stats, error);
+    else if (options->bench_builder > 0)
+        replay_ok = eti_sync_recorder_bench_recorded_builder(options->replay_file,
+                                                             options->bench_builder,
+                                                             stats, error);
+    else
+        replay_ok = eti_sync_recorder_replay(options->replay_file, stats,
+                                             error);
+    if (replay_ok)
+        print_bench_stats(options, stats, options->replay_file);
+    eti_stats_free(stats);
+
+    return replay_ok;
+}
+
+static void bench_fake_contacts(const EtiOptions *options)
+{
+    GHashTable *contacts;
+    EtiStats *stats;
+
+    contacts = create_test_contacts(options->fake_contacts);
+    stats = eti_stats_new();
+    eti_sync_recorder_bench_builder(contacts, NULL, options->bench_builder,
+                                    stats);
+    print_bench_stats(options, stats, "fake contacts");
+    eti_stats_free(stats);
+    g_hash_table_destroy(contacts);
+}
+
+int main(int argc, char **argv)
+{
+    GError *error = NULL;
+    GHashTable *eds_contacts = NULL;
+    EtiStats *eds_stats = NULL;
     EtiOptions *command_line_options;
+    gchar **uuids = NULL;
+    EtiDeviceJob *jobs = NULL;
+    guint n_jobs;
+    guint n_failed;
+    guint i;
 
     /** Create and Start the g_main_loop so that DBus can process messages TW
     *
@@ -262,78 +732,126 @@ int main(int argc, char **argv)
         return 0;
     }
 
+    if (command_line_options->replay_file != NULL) {
+        if (!replay_session(command_line_options, &error)) {
+            g_print("failed to replay session: %s\n", error->message);
+            goto error;
+        }
+        eti_options_free(command_line_options);
+        return 0;
+    }
+
+    if ((command_line_options->bench_builder > 0)
+            && (command_line_options->fake_contacts > 0)) {
+        bench_fake_contacts(command_line_options);
+        eti_options_free(command_line_options);
+        return 0;
+    }
+
     /** added contacts function for test here TW 09/04/16
     *	EBookClient *client = eti_eds_open_addressbook();
     *	eti_eds_get_contacts( (EBookClient *) client, NULL, NULL);
     **/
 
-	g_print("uuid = %s", command_line_options->idevice_uuid);
-    sync = eti_sync_new(command_line_options->idevice_uuid, &error);
-
+    if (command_line_options->daemon) {
+        if (!run_daemon(command_line_options, &error)) {
+            g_print("failed to run as a daemon: %s\n", error->message);
+            goto error;
+        }
+        eti_options_free(command_line_options);
+        return 0;
+    }
 
-  /*  if (NULL != error) {
-        g_print("failed to create sync object: %s\n", error->message);
-        goto error;
+    if (command_line_options->mock_device) {
+        /* there is a single fake device */
+        command_line_options->all_devices = FALSE;
+        g_strfreev(command_line_options->idevice_uuids);
+        command_line_options->idevice_uuids = NULL;
     }
-    g_assert(sync != NULL); */
 
-    eti_sync_start_sync(sync, &error);
+    uuids = get_device_uuids(command_line_options, &error);
     if (error != NULL) {
-        g_print("failed to start synchronization: %s\n", error->message);
+        g_print("failed to list devices: %s\n", error->message);
+        goto error;
+    }
+    if (command_line_options->all_devices && (uuids == NULL || uuids[0] == NULL)) {
+        g_print("no device found\n");
         goto error;
     }
 
-    if (command_line_options->wipe_contacts) {
-        g_print("All contacts will be deleted from your device in 5 seconds\n");
-        g_print("Press Ctrl+C to interrupt now\n");
-        g_usleep(5*G_USEC_PER_SEC);
-        eti_sync_wipe_all_contacts(sync, &error);
-        if (error != NULL) {
-            g_print("failed to delete all contacts: %s\n", error->message);
+    /* the EDS contacts are read and converted once, whatever the number
+     * of devices they are sent to
+     */
+    eds_stats = eti_stats_new();
+    if (command_line_options->transfer
+            && (command_line_options->fake_contacts > 0)) {
+        eds_contacts = create_test_contacts(command_line_options->fake_contacts);
+    } else if (command_line_options->transfer) {
+        eds_contacts = read_eds_contacts(command_line_options->addressbook_uri,
+                                         MAX(command_line_options->photo_size, 0),
+                                         eds_stats, &error);
+        if (eds_contacts == NULL) {
+            g_print("failed to transfer contacts: %s\n",
+                    (error != NULL)?error->message:"unknown error");
             goto error;
         }
     }
 
-    contacts = eti_sync_get_contacts(sync, &error);
-    if (command_line_options->save_photos)
-        save_photos(contacts);
-
-    g_hash_table_destroy(contacts);
-    contacts = NULL;
-    if (NULL != error) {
-        g_print("failed to get contacts: %s\n", error->message);
-        goto error;
+    /* no UUID means autodetecting a single device */
+    n_jobs = (uuids != NULL)?MAX(g_strv_length(uuids), 1):1;
+    jobs = g_new0(EtiDeviceJob, n_jobs);
+    for (i = 0; i < n_jobs; i++) {
+        jobs[i].options = command_line_options;
+        jobs[i].uuid = (uuids != NULL)?uuids[i]:NULL;
+        jobs[i].eds_contacts = eds_contacts;
     }
 
-    if (0) {
-        contacts = g_hash_table_new_full(g_str_hash, g_str_equal,
-                                         g_free, (GDestroyNotify)eti_contact_free);
-        g_hash_table_insert(contacts, g_strdup("6"), create_test_contact());
+    if (n_jobs == 1) {
+        sync_device(&jobs[0]);
+    } else {
+        GThread **threads;
+
+        threads = g_new0(GThread *, n_jobs);
+        for (i = 0; i < n_jobs; i++)
+            threads[i] = g_thread_new("eti-device", sync_device_thread,
+                                      &jobs[i]);
+        for (i = 0; i < n_jobs; i++)
+            g_thread_join(threads[i]);
+        g_free(threads);
     }
 
-    if (command_line_options->transfer) {
-        gboolean transfer_successful;
-        transfer_successful = transfer_eds_contacts(sync,
-                                                    command_line_options->addressbook_uri,
-                                                    &error);
-        if (!transfer_successful) {
-            g_print("failed to transfer contacts: %s\n", error->message);
-            goto error;
-        }
-    }
+    if (g_strcmp0(command_line_options->stats, "table") == 0) {
+        gchar *table;
 
-    eti_sync_stop_sync(sync, &error);
-    eti_sync_free(sync);
+        table = eti_stats_format(eds_stats, "Statistics for EDS:");
+        g_print("%s", table);
+        g_free(table);
+    }
+    n_failed = 0;
+    for (i = 0; i < n_jobs; i++) {
+        if (!report_device_job(&jobs[i]))
+            n_failed++;
+    }
+    if (g_strcmp0(command_line_options->stats, "json") == 0)
+        print_json_stats(eds_stats, jobs, n_jobs);
+
+    g_free(jobs);
+    eti_stats_free(eds_stats);
+    g_strfreev(uuids);
+    if (eds_contacts != NULL)
+        g_hash_table_destroy(eds_contacts);
     eti_options_free(command_line_options);
-    sync = NULL;
 
-    return 0;
+    return (n_failed == 0)?0:-1;
 
  error:
     if (error != NULL)
         g_clear_error(&error);
-    if (contacts != NULL)
-        g_hash_table_destroy(contacts);
+    if (eds_stats != NULL)
+        eti_stats_free(eds_stats);
+    g_strfreev(uuids);
+    if (eds_contacts != NULL)
+        g_hash_table_destroy(eds_contacts);
     if (command_line_options != NULL)
         eti_options_free(command_line_options);
 